@@ -0,0 +1,232 @@
+/* Cache and TLB models for projecting performance on an FPGA implementation
+ * Author: Richard James Howe
+ * License: Public Domain
+ * Repository: https//github.com/howerj/os
+ *
+ * Used live by 'vm -C spec' and on access traces, from 'vm -A', by 'cs'. A
+ * trace is CACHE_MAGIC then a pair of words per access, the virtual address
+ * with the low three bits of the kind and the physical address with the
+ * CACHE_UNCACHED bit of it in bit zero.
+ * Every fetch, load and store goes through a set associative L1-I or L1-D
+ * with the given size, ways, line size and replacement policy, unless it is
+ * uncached, such as an access to a device; accesses made with virtual memory
+ * on, outside of the kernel segment, go through a TLB first. CACHE_FLUSH
+ * records invalidate the TLB entry for their virtual address, or with
+ * CACHE_VIRTUAL set the whole TLB, as the guest flushes its own.
+ * A 'spec' is a comma separated list of settings, for example:
+ *
+ *	l1i=16K:2:32:lru,l1d=32K:4:64:random,tlb=64:64:fifo,miss=20,walk=40
+ *
+ * Caches are 'size:ways:line:policy', the TLB 'entries:ways:policy' with
+ * PAGE_SIZE pages. Policies are 'lru', 'fifo' or 'random'. The cycle
+ * estimate is one per instruction fetched plus 'miss' cycles for each cache
+ * miss and 'walk' for each TLB miss, a simple in order, blocking pipeline. */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_PAGE  (8192ull) /* matches PAGE_SIZE in 'vm.c' */
+#define CACHE_SPEC  "l1i=16K:2:32:lru,l1d=16K:2:32:lru,tlb=64:64:lru,miss=20,walk=40"
+#define CACHE_MAGIC (0x31534343414D56ull) /* "VMACCS1", access trace header */
+
+enum { CACHE_LRU, CACHE_FIFO, CACHE_RANDOM, };
+enum { CACHE_READ, CACHE_WRITE, CACHE_EXECUTE, CACHE_FLUSH, CACHE_VIRTUAL = 4, CACHE_UNCACHED = 8, }; /* access kinds, as READ, WRITE and EXECUTE in 'vm.c' */
+
+typedef struct {
+	uint64_t *tag, *stamp; /* per way, tags are line numbers plus one so zero is empty */
+	uint64_t size, sets, ways, line, policy;
+	uint64_t clock, random, hits, misses;
+} cache_t;
+
+typedef struct {
+	cache_t i, d, tlb;
+	uint64_t miss, walk, fetches, cycles;
+} cache_sim_t;
+
+static const char *cache_policies[] = { "lru", "fifo", "random", };
+
+static inline int cache_number(const char *s, uint64_t *n) {
+	assert(s);
+	assert(n);
+	char *end = NULL;
+	const unsigned long long r = strtoull(s, &end, 0);
+	const uint64_t scale = *end == 'K' ? 1ull << 10 : *end == 'M' ? 1ull << 20 : 1ull;
+	if (end == s || (scale != 1 && *++end != '\0') || (scale == 1 && *end != '\0'))
+		return -1;
+	*n = r * scale;
+	return 0;
+}
+
+static inline int cache_init(cache_t *c, uint64_t size, uint64_t ways, uint64_t line, uint64_t policy) {
+	assert(c);
+	free(c->tag);
+	free(c->stamp);
+	memset(c, 0, sizeof *c);
+	if (!size || !ways || !line || (line & (line - 1)) || size % (ways * line) || policy > CACHE_RANDOM)
+		return -1;
+	c->size = size;
+	c->ways = ways;
+	c->line = line;
+	c->sets = size / (ways * line);
+	c->policy = policy;
+	c->random = 0x9E3779B97F4A7C15ull;
+	c->tag = calloc(c->sets * ways, sizeof *c->tag);
+	c->stamp = calloc(c->sets * ways, sizeof *c->stamp);
+	return c->tag && c->stamp ? 0 : -1;
+}
+
+static inline void cache_fini(cache_t *c) {
+	assert(c);
+	free(c->tag);
+	free(c->stamp);
+	memset(c, 0, sizeof *c);
+}
+
+static inline void cache_flush(cache_t *c) {
+	assert(c);
+	if (c->tag)
+		memset(c->tag, 0, c->sets * c->ways * sizeof *c->tag);
+}
+
+static inline void cache_invalidate(cache_t *c, uint64_t addr) {
+	assert(c);
+	if (!c->tag)
+		return;
+	const uint64_t line = addr / c->line;
+	uint64_t *tag = &c->tag[(line % c->sets) * c->ways];
+	for (uint64_t w = 0; w < c->ways; w++)
+		if (tag[w] == line + 1)
+			tag[w] = 0;
+}
+
+/* Returns 1 on a hit, 0 on a miss after which the line is filled */
+static inline int cache_access(cache_t *c, uint64_t addr) {
+	assert(c);
+	const uint64_t line = addr / c->line, set = line % c->sets;
+	uint64_t *tag = &c->tag[set * c->ways], *stamp = &c->stamp[set * c->ways], victim = 0;
+	c->clock++;
+	for (uint64_t w = 0; w < c->ways; w++) {
+		if (tag[w] == line + 1) {
+			if (c->policy == CACHE_LRU)
+				stamp[w] = c->clock;
+			c->hits++;
+			return 1;
+		}
+		if (stamp[w] < stamp[victim])
+			victim = w;
+	}
+	c->misses++;
+	if (c->policy == CACHE_RANDOM && tag[victim]) { /* fill empty ways first */
+		c->random ^= c->random << 13;
+		c->random ^= c->random >> 7;
+		c->random ^= c->random << 17;
+		victim = c->random % c->ways;
+	}
+	tag[victim] = line + 1;
+	stamp[victim] = c->clock;
+	return 0;
+}
+
+static inline int cache_setting(cache_t *c, char *value, int tlb) {
+	assert(c);
+	assert(value);
+	char *field[4] = { NULL, };
+	size_t n = 0;
+	for (char *s = value; n < 4; s = NULL)
+		if (!(field[n++] = strtok(s, ":")))
+			break;
+	uint64_t size = 0, ways = 0, line = CACHE_PAGE, policy = 0;
+	if (cache_number(field[0] ? field[0] : "", &size) < 0 || cache_number(field[1] ? field[1] : "", &ways) < 0)
+		return -1;
+	if (!tlb && cache_number(field[2] ? field[2] : "", &line) < 0)
+		return -1;
+	const char *name = field[tlb ? 2 : 3];
+	for (policy = 0; name && policy < sizeof cache_policies / sizeof cache_policies[0]; policy++)
+		if (!strcmp(name, cache_policies[policy]))
+			break;
+	if (!name || policy > CACHE_RANDOM)
+		return -1;
+	return cache_init(c, tlb ? size * line : size, ways, line, policy);
+}
+
+/* Configure from CACHE_SPEC and then 'spec', if not NULL */
+static inline int cache_sim_init(cache_sim_t *s, const char *spec) {
+	assert(s);
+	char buf[512];
+	const char *specs[] = { CACHE_SPEC, spec, };
+	for (size_t i = 0; i < 2 && specs[i]; i++) {
+		if (snprintf(buf, sizeof buf, "%s", specs[i]) >= (int)sizeof buf)
+			return -1;
+		for (char *setting = buf, *next = NULL; setting; setting = next) {
+			if ((next = strchr(setting, ',')))
+				*next++ = '\0';
+			if (!*setting)
+				continue;
+			char *value = strchr(setting, '=');
+			if (!value)
+				return -1;
+			*value++ = '\0';
+			int r = -1;
+			if (!strcmp(setting, "l1i")) r = cache_setting(&s->i, value, 0);
+			else if (!strcmp(setting, "l1d")) r = cache_setting(&s->d, value, 0);
+			else if (!strcmp(setting, "tlb")) r = cache_setting(&s->tlb, value, 1);
+			else if (!strcmp(setting, "miss")) r = cache_number(value, &s->miss);
+			else if (!strcmp(setting, "walk")) r = cache_number(value, &s->walk);
+			if (r < 0)
+				return -1;
+		}
+	}
+	s->fetches = s->cycles = 0;
+	return 0;
+}
+
+static inline void cache_sim_fini(cache_sim_t *s) {
+	assert(s);
+	cache_fini(&s->i);
+	cache_fini(&s->d);
+	cache_fini(&s->tlb);
+}
+
+static inline void cache_sim_access(cache_sim_t *s, unsigned kind, uint64_t vaddr, uint64_t paddr) {
+	assert(s);
+	if ((kind & 3u) == CACHE_FLUSH) {
+		if (kind & CACHE_VIRTUAL)
+			cache_flush(&s->tlb);
+		else
+			cache_invalidate(&s->tlb, vaddr);
+		return;
+	}
+	if ((kind & CACHE_VIRTUAL) && !cache_access(&s->tlb, vaddr))
+		s->cycles += s->walk;
+	if ((kind & 3u) == CACHE_EXECUTE) {
+		s->fetches++;
+		s->cycles++;
+	}
+	if (!(kind & CACHE_UNCACHED) && !cache_access((kind & 3u) == CACHE_EXECUTE ? &s->i : &s->d, paddr))
+		s->cycles += s->miss;
+}
+
+static inline int cache_sim_report(cache_sim_t *s, FILE *out) {
+	assert(s);
+	assert(out);
+	const char *names[] = { "l1i", "l1d", "tlb", };
+	cache_t *c[] = { &s->i, &s->d, &s->tlb, };
+	int r = fprintf(out, "cache,size,ways,line,policy,accesses,hits,misses,hit_rate\n");
+	for (size_t i = 0; r >= 0 && i < 3; i++) {
+		const uint64_t n = c[i]->hits + c[i]->misses;
+		r = fprintf(out, "%s,%"PRIu64",%"PRIu64",%"PRIu64",%s,%"PRIu64",%"PRIu64",%"PRIu64",%.4f\n",
+			names[i], i == 2 ? c[i]->sets * c[i]->ways : c[i]->size, c[i]->ways, c[i]->line, cache_policies[c[i]->policy],
+			n, c[i]->hits, c[i]->misses, n ? (double)c[i]->hits / n : 0.0);
+	}
+	if (r >= 0)
+		r = fprintf(out, "cycles,%"PRIu64",instructions,%"PRIu64",cpi,%.3f\n", s->cycles, s->fetches, s->fetches ? (double)s->cycles / s->fetches : 0.0);
+	return r < 0 ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* Run access traces from 'vm -A' through cache and TLB models, see 'cache.h'
+ * Author: Richard James Howe
+ * License: Public Domain
+ * Repository: https//github.com/howerj/os
+ *
+ * Each specification given is simulated in the same pass over the trace, so
+ * sweeping parameters costs one read of it. A report is printed for each. */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+#define SPECS (64)
+
+int main(int argc, char **argv) {
+	static cache_sim_t sims[SPECS];
+	if (argc < 2 || argc - 2 > SPECS) {
+		(void)fprintf(stderr, "usage: %s trace [spec]...\n", argv[0]);
+		return 1;
+	}
+	const int n = argc == 2 ? 1 : argc - 2;
+	for (int i = 0; i < n; i++) {
+		if (cache_sim_init(&sims[i], argc == 2 ? NULL : argv[i + 2]) < 0) {
+			(void)fprintf(stderr, "invalid cache specification '%s'\n", argv[i + 2]);
+			return 1;
+		}
+	}
+	errno = 0;
+	FILE *f = fopen(argv[1], "rb");
+	if (!f) {
+		(void)fprintf(stderr, "Could not open file '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	uint64_t magic = 0, record[2];
+	if (fread(&magic, 1, sizeof magic, f) != sizeof magic || magic != CACHE_MAGIC) {
+		(void)fprintf(stderr, "'%s' is not an access trace\n", argv[1]);
+		return 1;
+	}
+	while (fread(record, 1, sizeof record, f) == sizeof record)
+		for (int i = 0; i < n; i++)
+			cache_sim_access(&sims[i], (record[0] & 7ull) | ((record[1] & 1ull) << 3), record[0] & ~7ull, record[1] & ~7ull);
+	if (ferror(f) || fclose(f) < 0)
+		return 1;
+	for (int i = 0; i < n; i++) {
+		if (argc > 2 && printf("spec,%s\n", argv[i + 2]) < 0)
+			return 1;
+		if (cache_sim_report(&sims[i], stdout) < 0)
+			return 1;
+		cache_sim_fini(&sims[i]);
+	}
+	return 0;
+}
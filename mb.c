@@ -0,0 +1,524 @@
+/* Generate guest microbenchmark images for 'make bench'
+ * Author: Richard James Howe
+ * License: Public Domain
+ * Repository: https//github.com/howerj/os
+ *
+ * Each benchmark is a loop that halts the VM when done, its name and the
+ * number of operations it performs, ALU operations, memory accesses, byte
+ * stores, branches, TLB misses, trap round trips or characters output, are
+ * printed for 'vm -b stats,operations' to give instructions per second and
+ * nanoseconds per operation. Loops
+ * count down to zero, as the zero flag is sticky the flags are restored
+ * from r9 after an inner loop ends. 'mb-native.img' and 'mb-riscv.img' are
+ * instead self tests, the latter for 'vm -R', run by 'make test'; they halt
+ * with -1 if a check fails. */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_START (0x0000000080000000ull)
+#define IO_START     (0x0000000004000000ull)
+#define KSEG_START   (0xFFFF000000000000ull)
+#define PAGE_SIZE    (8192ull)
+#define IO(X, Y)     (IO_START + ((X) * PAGE_SIZE) + ((Y) * 8ull))
+#define DATA         (0x1000ul) /* constants, as a word index */
+#define BUFFER       (MEMORY_START + 0x100000ull)
+#define NELEMS(X)    (sizeof (X) / sizeof ((X)[0]))
+
+enum { IMM = 0x10, EXT = 0x20, REL = 0x40, };
+enum { Z = 2, C = 4, };
+enum { INTR = 60, PRIV, VIRT, WALK, };
+enum { TLB_BIT_IN_USE = 48, TLB_BIT_DIRTY = 51, TLB_BIT_READ, TLB_BIT_WRITE, TLB_BIT_EXECUTE, };
+enum {
+	ALU_A = 0, ALU_B, ALU_AND = 3, ALU_OR, ALU_XOR, ALU_MUL = 8, ALU_ADD = 11, ALU_SUB = 13, ALU_ROL = 18,
+	ALU_JUMP = 32, ALU_GET_FLAGS = 48, ALU_SET_FLAGS, ALU_SET_TRAPS = 51, ALU_SET_SREG = 53,
+	ALU_LOAD_WORD = 64, ALU_STORE_WORD, ALU_LOAD_BYTE, ALU_STORE_BYTE,
+	ALU_TRAP = 80, ALU_TRAP_RETURN = 85,
+};
+
+static uint64_t m[0x10000]; /* image, 512 KiB */
+static size_t here, data;
+
+static size_t emit(unsigned alu, unsigned a, unsigned b, uint32_t imm, unsigned cond) {
+	assert(here < DATA);
+	const uint64_t op = ((uint64_t)cond << 28) | ((uint64_t)alu << 16) | ((uint64_t)b << 8) | a;
+	m[here] = (op << 32) | imm;
+	return here++;
+}
+
+static uint64_t addr(size_t i) { return MEMORY_START + (i * sizeof (uint64_t)); }
+static void op(unsigned alu, unsigned a, unsigned b) { (void)emit(alu, a, b, 0, 0); }
+static void opi(unsigned alu, unsigned a, uint32_t imm) { (void)emit(alu, a, IMM, imm, 0); }
+static void lit(unsigned r, uint32_t imm) { (void)emit(ALU_A, r | IMM, 0, imm, 0); }
+
+static void constant(unsigned r, uint64_t c) { /* load a full 64-bit value from the data area */
+	assert(data < NELEMS(m));
+	m[data] = c;
+	(void)emit(ALU_LOAD_WORD, r | IMM, 0, addr(data++), 0);
+}
+
+/* Jumps write their A register back, which sets the zero flag if it is zero,
+ * so r9 is named as it is never zero */
+static void jump(size_t to, unsigned cond) { (void)emit(ALU_JUMP, IMM | EXT | REL | 9, 0, (to - here) * sizeof (uint64_t), cond); }
+static size_t jump_forward(unsigned cond) { return emit(ALU_JUMP, IMM | EXT | REL | 9, 0, 0, cond); }
+static void patch(size_t at) { m[at] = (m[at] & ~0xFFFFFFFFull) | (uint32_t)((here - at) * sizeof (uint64_t)); }
+
+static size_t loop_start(unsigned r, uint32_t count) {
+	lit(r, count);
+	return here;
+}
+
+static void loop_end(unsigned r, size_t start) { /* decrement 'r', loop until zero then clear the flags */
+	opi(ALU_SUB, r, 1);
+	const size_t exit = jump_forward(Z);
+	jump(start, 0);
+	patch(exit);
+	op(ALU_SET_FLAGS, 9, 0);
+}
+
+static void begin(void) {
+	memset(m, 0, sizeof m);
+	here = 0;
+	data = DATA;
+	op(ALU_GET_FLAGS, 9, 0);
+}
+
+static void halt(uint64_t base) {
+	constant(1, base + IO(1, 0));
+	op(ALU_STORE_WORD, 1, 1);
+}
+
+static uint64_t alu(void) {
+	constant(2, 0x9E3779B97F4A7C15ull);
+	constant(5, 0xD6E8FEB86659FD93ull);
+	lit(1, 1);
+	lit(3, 3);
+	lit(4, 5);
+	const size_t l = loop_start(0, 4000000);
+	op(ALU_ADD, 1, 2);
+	op(ALU_XOR, 3, 1);
+	op(ALU_ROL, 3, 4);
+	op(ALU_MUL, 4, 5);
+	op(ALU_OR, 3, 4);
+	op(ALU_AND, 3, 2);
+	loop_end(0, l);
+	halt(0);
+	return 4000000ull * 6;
+}
+
+static uint64_t memory(void) {
+	const size_t o = loop_start(8, 256);
+	constant(1, BUFFER);
+	const size_t l = loop_start(0, 8192);
+	op(ALU_STORE_WORD, 1, 0);
+	op(ALU_B, 2, 1);
+	op(ALU_LOAD_WORD, 2, 0); /* loads replace the address register */
+	opi(ALU_ADD, 1, sizeof (uint64_t));
+	loop_end(0, l);
+	loop_end(8, o);
+	halt(0);
+	return 256ull * 8192 * 2;
+}
+
+static uint64_t bytes(void) {
+	lit(3, 0x5A);
+	const size_t o = loop_start(8, 64);
+	constant(1, BUFFER);
+	const size_t l = loop_start(0, 65536);
+	op(ALU_STORE_BYTE, 1, 3);
+	opi(ALU_ADD, 1, 1);
+	loop_end(0, l);
+	loop_end(8, o);
+	halt(0);
+	return 64ull * 65536;
+}
+
+static uint64_t branch(void) {
+	const size_t l = loop_start(0, 1000000);
+	for (int i = 0; i < 4; i++) {
+		jump(here + 1, 0);       /* taken */
+		jump(here + 2, 0x1);     /* not taken, N is never set */
+		op(ALU_ADD, 1, 0);
+	}
+	loop_end(0, l);
+	halt(0);
+	return 1000000ull * 8;
+}
+
+/* Page tables for the walker mapping 'pages' pages from 'va' onto BUFFER,
+ * code stays where it is in an 8 MiB superpage. Returns the word index of
+ * the first page's entry. */
+static size_t page_tables(uint64_t va, uint64_t pages) {
+	const size_t t3 = 0x2000, t2 = 0x2400, t1 = 0x2800, t0 = 0x2C00; /* word indexes of tables */
+	const uint64_t valid = 1ull << TLB_BIT_IN_USE, rwx = (1ull << TLB_BIT_READ) | (1ull << TLB_BIT_WRITE) | (1ull << TLB_BIT_EXECUTE);
+	m[t3 + 0] = addr(t2) | valid;
+	m[t2 + 0] = addr(t1) | valid;
+	m[t1 + ((MEMORY_START >> 23) & 0x3FF)] = MEMORY_START | valid | rwx;
+	m[t1 + ((va >> 23) & 0x3FF)] = addr(t0) | valid;
+	for (uint64_t i = 0; i < pages; i++)
+		m[t0 + i] = (BUFFER + (i * PAGE_SIZE)) | valid | rwx;
+	constant(2, addr(t3));
+	(void)emit(ALU_SET_SREG, 7 | IMM, 2, 2 /* SR_PTBR */, 0);
+	return t0;
+}
+
+/* With the page table walker on, 128 pages are written in turn; twice the
+ * size of the TLB, each access misses. */
+static uint64_t tlb(void) {
+	const uint64_t va = 0x100000000ull;
+	(void)page_tables(va, 128);
+	constant(10, (1ull << PRIV) | (1ull << VIRT) | (1ull << WALK));
+	op(ALU_SET_FLAGS, 10, 0);
+	op(ALU_GET_FLAGS, 9, 0);
+	const size_t o = loop_start(8, 20000);
+	constant(1, va);
+	const size_t l = loop_start(0, 128);
+	op(ALU_STORE_WORD, 1, 1);
+	constant(2, PAGE_SIZE);
+	op(ALU_ADD, 1, 2);
+	loop_end(0, l);
+	loop_end(8, o);
+	halt(KSEG_START);
+	return 20000ull * 128;
+}
+
+/* Trap to a handler that returns straight away, trap entry saves the
+ * program counter in r13 as set in the flags */
+static uint64_t trap(void) {
+	constant(10, (1ull << PRIV) | (13ull << 8) | (14ull << 16));
+	op(ALU_SET_FLAGS, 10, 0);
+	op(ALU_GET_FLAGS, 9, 0);
+	const size_t skip = jump_forward(0);
+	const size_t handler = here;
+	opi(ALU_ADD, 13, sizeof (uint64_t));
+	op(ALU_TRAP_RETURN, 13, 0);
+	patch(skip);
+	constant(2, addr(handler));
+	lit(6, 0);
+	(void)emit(ALU_SET_TRAPS, 6, 2, 0, 0);
+	op(ALU_SET_FLAGS, 9, 0);
+	const size_t l = loop_start(0, 1000000);
+	op(ALU_TRAP, 6, 7);
+	loop_end(0, l);
+	halt(0);
+	return 1000000;
+}
+
+static uint64_t uart(void) {
+	constant(10, IO(2, 2));
+	constant(11, IO(2, 0));
+	lit(3, '.');
+	lit(4, 2);
+	const size_t l = loop_start(0, 200000);
+	op(ALU_STORE_WORD, 10, 3);
+	op(ALU_STORE_WORD, 11, 4);
+	loop_end(0, l);
+	halt(0);
+	return 200000;
+}
+
+static void halt_with(int32_t status) {
+	constant(1, IO(1, 0));
+	(void)emit(ALU_A, 2 | IMM | EXT, 0, (uint32_t)status, 0);
+	op(ALU_STORE_WORD, 1, 2);
+	jump(here, 0);
+}
+
+/* Self test of the native core. A write through a TLB entry the walker
+ * filled on a read must set the dirty bit of the page table entry. A loop
+ * polling 'tick' must leave as soon as it passes its deadline. Trap
+ * handlers take the return address in r13; a handler that itself traps must
+ * still return to user mode. */
+static uint64_t native(void) {
+	constant(10, (1ull << PRIV) | (13ull << 8) | (14ull << 16));
+	op(ALU_SET_FLAGS, 10, 0);
+	const size_t skip = jump_forward(0);
+	const size_t fail = here;
+	halt_with(-1);
+	const size_t outer = here;
+	op(ALU_B, 12, 13);
+	lit(6, 1);
+	op(ALU_TRAP, 6, 7);
+	opi(ALU_ADD, 12, sizeof (uint64_t));
+	op(ALU_TRAP_RETURN, 12, 0);
+	const size_t inner = here;
+	opi(ALU_ADD, 13, sizeof (uint64_t));
+	op(ALU_TRAP_RETURN, 13, 0);
+	patch(skip);
+	constant(2, addr(outer));
+	lit(6, 0);
+	(void)emit(ALU_SET_TRAPS, 6, 2, 0, 0);
+	constant(2, addr(inner));
+	lit(6, 1);
+	(void)emit(ALU_SET_TRAPS, 6, 2, 0, 0);
+
+	/* dirty bit written back by the walker */
+	const size_t pte = page_tables(0x100000000ull, 1);
+	constant(11, (1ull << PRIV) | (1ull << VIRT) | (1ull << WALK));
+	constant(1, 0x100000000ull);
+	op(ALU_SET_FLAGS, 11, 0);
+	op(ALU_B, 2, 1);
+	op(ALU_LOAD_WORD, 2, 0);
+	op(ALU_STORE_WORD, 1, 1);
+	op(ALU_SET_FLAGS, 10, 0);
+	constant(2, addr(pte));
+	op(ALU_LOAD_WORD, 2, 0);
+	constant(3, 1ull << TLB_BIT_DIRTY);
+	op(ALU_SET_FLAGS, 10, 0);
+	op(ALU_AND, 2, 3);
+	jump(fail, Z);
+
+	/* polling 'tick' until a deadline, fast forwarded, must not overshoot */
+	constant(4, IO(1, 2));
+	op(ALU_B, 5, 4);
+	op(ALU_LOAD_WORD, 5, 0);
+	constant(6, 20000000);
+	op(ALU_ADD, 5, 6);
+	const size_t poll = here;
+	op(ALU_B, 7, 4);
+	op(ALU_LOAD_WORD, 7, 0);
+	op(ALU_SUB, 7, 5);
+	jump(poll, C);
+	opi(ALU_SUB, 7, 4); /* the length of the loop */
+	const size_t deadline = jump_forward(C);
+	jump(fail, 0);
+	patch(deadline);
+
+	/* nested traps from user mode */
+	constant(10, (13ull << 8) | (14ull << 16));
+	op(ALU_SET_FLAGS, 10, 0);
+	lit(6, 0);
+	op(ALU_TRAP, 6, 7);
+	op(ALU_GET_FLAGS, 2, 0);
+	constant(3, (1ull << PRIV) | (1ull << INTR));
+	op(ALU_SET_FLAGS, 10, 0); /* clear the zero flag */
+	op(ALU_AND, 2, 3);
+	const size_t user = jump_forward(Z);
+	jump(fail, 0);
+	patch(user);
+
+	halt_with(1);
+	return 0;
+}
+
+/* RV64IMA instructions are packed two to a word, 'rvhere' counts them */
+enum { X0, T0 = 5, T1, T2, S1 = 9, S2 = 18, T3 = 28, T4, T5, T6, };
+enum { MSTATUS = 0x300, MTVEC = 0x305, MEPC = 0x341, MCAUSE = 0x342, SATP = 0x180, TIME = 0xC01, };
+enum { RV_LOAD = 0x03, RV_IMM = 0x13, RV_AUIPC = 0x17, RV_IMM32 = 0x1B, RV_STORE = 0x23, RV_AMO = 0x2F, RV_OP = 0x33, RV_BRANCH = 0x63, RV_JAL = 0x6F, RV_SYSTEM = 0x73, };
+enum { BEQ = 0, BNE = 1, BLTU = 6, };
+
+static size_t rvhere;
+
+static uint64_t rv_pc(size_t i) { return MEMORY_START + (i * 4u); }
+
+static void rv_set(size_t i, uint32_t in) {
+	assert(i / 2 < DATA);
+	const unsigned shift = 32u * (i % 2u);
+	m[i / 2] = (m[i / 2] & ~(0xFFFFFFFFull << shift)) | ((uint64_t)in << shift);
+}
+
+static size_t rv(uint32_t in) { rv_set(rvhere, in); return rvhere++; }
+static uint32_t rv_r(unsigned f7, unsigned rs2, unsigned rs1, unsigned f3, unsigned rd, unsigned opc) { return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc; }
+static uint32_t rv_i(int32_t imm, unsigned rs1, unsigned f3, unsigned rd, unsigned opc) { return ((uint32_t)imm << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc; }
+static void rv_addi(unsigned rd, unsigned rs1, int32_t imm) { (void)rv(rv_i(imm, rs1, 0, rd, RV_IMM)); }
+static void rv_ld(unsigned rd, unsigned rs1, int32_t imm) { (void)rv(rv_i(imm, rs1, 3, rd, RV_LOAD)); }
+static void rv_csr(unsigned f3, unsigned rd, unsigned csr, unsigned rs1) { (void)rv(rv_i((int32_t)csr, rs1, f3, rd, RV_SYSTEM)); } /* 1 write, 2 set, 3 clear */
+
+static void rv_sd(unsigned rs2, unsigned rs1, int32_t imm) {
+	(void)rv(((uint32_t)(imm >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (3u << 12) | ((imm & 31u) << 7) | RV_STORE);
+}
+
+static uint32_t rv_b(int32_t offset, unsigned rs2, unsigned rs1, unsigned f3) {
+	const uint32_t o = (uint32_t)offset;
+	return (((o >> 12) & 1u) << 31) | (((o >> 5) & 0x3Fu) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (((o >> 1) & 0xFu) << 8) | (((o >> 11) & 1u) << 7) | RV_BRANCH;
+}
+
+static void rv_branch(unsigned f3, unsigned rs1, unsigned rs2, size_t to) { (void)rv(rv_b((int32_t)(to - rvhere) * 4, rs2, rs1, f3)); }
+static size_t rv_branch_forward(unsigned f3, unsigned rs1, unsigned rs2) { return rv(rv_b(0, rs2, rs1, f3)); }
+static void rv_patch(size_t at) { rv_set(at, (uint32_t)(m[at / 2] >> (32u * (at % 2u))) | rv_b((int32_t)(rvhere - at) * 4, 0, 0, 0)); }
+
+static uint32_t rv_j(int32_t offset, unsigned rd) {
+	const uint32_t o = (uint32_t)offset;
+	return (((o >> 20) & 1u) << 31) | (((o >> 1) & 0x3FFu) << 21) | (((o >> 11) & 1u) << 20) | (((o >> 12) & 0xFFu) << 12) | (rd << 7) | RV_JAL;
+}
+
+static void rv_jal(unsigned rd, size_t to) { (void)rv(rv_j((int32_t)(to - rvhere) * 4, rd)); }
+static void rv_patch_jal(size_t at) { rv_set(at, rv_j((int32_t)(rvhere - at) * 4, X0)); }
+
+static void rv_la(unsigned rd, uint64_t target) { /* load an address near the code */
+	const int64_t offset = (int64_t)(target - rv_pc(rvhere));
+	(void)rv((uint32_t)((offset + 0x800) & ~0xFFFll) | (rd << 7) | RV_AUIPC);
+	rv_addi(rd, rd, (int32_t)((offset & 0xFFF) ^ 0x800) - 0x800);
+}
+
+static void rv_li(unsigned rd, uint64_t c) { /* a full 64-bit value from the data area */
+	assert(data < NELEMS(m));
+	m[data] = c;
+	rv_la(rd, addr(data++));
+	rv_ld(rd, rd, 0);
+}
+
+static void rv_expect(unsigned rs, uint64_t c, size_t fail) {
+	rv_li(T6, c);
+	rv_branch(BNE, rs, T6, fail);
+}
+
+static uint64_t riscv(void) {
+	const size_t root = 0x2000, counter = 0x1FFF; /* word indexes, the page table is 4 KiB aligned */
+	memset(m, 0, sizeof m); /* no native prologue */
+	rvhere = 0;
+	m[counter] = 10;
+	m[root] = ((MEMORY_START >> 12) << 10) | 0xF; /* virtual 0 to 1 GiB is RAM, valid, readable, writable and executable */
+	const size_t start = rv(0);
+	const size_t fail = rvhere;
+	rv_li(T0, IO(1, 0));
+	rv_addi(T1, X0, -1);
+	rv_sd(T1, T0, 0);
+	rv_jal(X0, rvhere);
+
+	/* trap handler: an illegal instruction is skipped and counted in s2,
+	 * an ecall from supervisor mode returns to machine mode at s1 */
+	const size_t handler = rvhere;
+	rv_csr(2, T5, MCAUSE, X0);
+	rv_addi(T6, X0, 9);
+	const size_t ecall = rv_branch_forward(BEQ, T5, T6);
+	rv_addi(T6, X0, 2);
+	rv_branch(BNE, T5, T6, fail);
+	rv_addi(S2, S2, 1);
+	rv_csr(2, T5, MEPC, X0);
+	rv_addi(T5, T5, 4);
+	rv_csr(1, X0, MEPC, T5);
+	(void)rv(0x30200073); /* mret */
+	rv_patch(ecall);
+	rv_csr(1, X0, MEPC, S1);
+	rv_li(T5, 3ull << 11);
+	rv_csr(2, X0, MSTATUS, T5);
+	(void)rv(0x30200073);
+
+	/* supervisor mode, running from virtual addresses */
+	const size_t smode = rvhere;
+	rv_li(T0, 0x100000);
+	rv_li(T1, 0xABCD);
+	rv_sd(T1, T0, 0x100);
+	rv_ld(T2, T0, 0x100);
+	rv_branch(BNE, T1, T2, fail);
+	(void)rv(0x00000073); /* ecall */
+
+	rv_patch_jal(start);
+	rv_la(T0, rv_pc(handler));
+	rv_csr(1, X0, MTVEC, T0);
+
+	/* M extension */
+	rv_addi(T0, X0, -7);
+	rv_addi(T1, X0, 2);
+	(void)rv(rv_r(1, T1, T0, 4, T2, RV_OP)); /* div */
+	rv_expect(T2, -3ll, fail);
+	(void)rv(rv_r(1, T1, T0, 6, T2, RV_OP)); /* rem */
+	rv_expect(T2, -1ll, fail);
+	(void)rv(rv_r(1, X0, T0, 5, T2, RV_OP)); /* divu by zero */
+	rv_expect(T2, ~0ull, fail);
+	rv_addi(T3, X0, -1);
+	(void)rv(rv_r(1, T3, T3, 3, T2, RV_OP)); /* mulhu */
+	rv_expect(T2, ~1ull, fail);
+	rv_li(T0, 0x7FFFFFFF);
+	(void)rv(rv_i(1, T0, 0, T2, RV_IMM32)); /* addiw */
+	rv_expect(T2, 0xFFFFFFFF80000000ull, fail);
+
+	/* A extension */
+	rv_la(T0, addr(counter));
+	rv_addi(T1, X0, 5);
+	(void)rv(rv_r(0x00, T1, T0, 3, T2, RV_AMO)); /* amoadd.d */
+	rv_expect(T2, 10, fail);
+	(void)rv(rv_r(0x08, X0, T0, 3, T3, RV_AMO)); /* lr.d */
+	rv_addi(T3, T3, 1);
+	(void)rv(rv_r(0x0C, T3, T0, 3, T4, RV_AMO)); /* sc.d */
+	rv_expect(T4, 0, fail);
+	(void)rv(rv_r(0x0C, T3, T0, 3, T4, RV_AMO)); /* sc.d without a reservation */
+	rv_expect(T4, 1, fail);
+	rv_ld(T2, T0, 0);
+	rv_expect(T2, 16, fail);
+
+	/* an illegal instruction traps and is skipped */
+	(void)rv(0);
+	rv_expect(S2, 1, fail);
+
+	/* 'time' keeps counting when the timer expires */
+	rv_li(T0, IO(1, 3));
+	rv_addi(T1, X0, 100);
+	rv_sd(T1, T0, 0);
+	rv_csr(2, T3, TIME, X0);
+	rv_addi(T1, X0, 500);
+	const size_t spin = rvhere;
+	rv_addi(T1, T1, -1);
+	rv_branch(BNE, T1, X0, spin);
+	rv_sd(X0, T0, 0);
+	rv_csr(2, T4, TIME, X0);
+	(void)rv(rv_r(0x20, T3, T4, 0, T4, RV_OP)); /* sub */
+	rv_li(T6, 1000);
+	rv_branch(BLTU, T4, T6, fail);
+
+	/* Sv39 with one gigapage, then supervisor mode at virtual addresses */
+	rv_li(T0, (8ull << 60) | (addr(root) >> 12));
+	rv_csr(1, X0, SATP, T0);
+	(void)rv(0x12000073); /* sfence.vma */
+	rv_li(T0, rv_pc(smode) - MEMORY_START);
+	rv_csr(1, X0, MEPC, T0);
+	rv_li(T0, 3ull << 11);
+	rv_csr(3, X0, MSTATUS, T0);
+	rv_li(T0, 1ull << 11);
+	rv_csr(2, X0, MSTATUS, T0);
+	rv_la(S1, rv_pc(rvhere + 3));
+	(void)rv(0x30200073); /* mret */
+	rv_csr(1, X0, SATP, X0);
+	rv_li(T0, MEMORY_START + 0x100100);
+	rv_ld(T1, T0, 0);
+	rv_expect(T1, 0xABCD, fail);
+	rv_la(T0, addr(root));
+	rv_ld(T1, T0, 0);
+	rv_expect(T1, m[root] | 0xC0, fail); /* accessed and dirty */
+
+	rv_li(T0, IO(1, 0));
+	rv_addi(T1, X0, 1);
+	rv_sd(T1, T0, 0);
+	rv_jal(X0, rvhere);
+	return 0;
+}
+
+static const struct { const char *name; uint64_t (*generate)(void); } benchmarks[] = {
+	{ "alu", alu, }, { "memory", memory, }, { "bytes", bytes, }, { "branch", branch, },
+	{ "tlb", tlb, }, { "trap", trap, }, { "uart", uart, }, { "native", native, }, { "riscv", riscv, },
+};
+
+int main(int argc, char **argv) {
+	if (argc != 1) {
+		(void)fprintf(stderr, "usage: %s\n", argv[0]);
+		return 1;
+	}
+	for (size_t i = 0; i < NELEMS(benchmarks); i++) {
+		char name[64];
+		(void)snprintf(name, sizeof name, "mb-%s.img", benchmarks[i].name);
+		begin();
+		const uint64_t ops = benchmarks[i].generate();
+		errno = 0;
+		FILE *f = fopen(name, "wb");
+		if (!f) {
+			(void)fprintf(stderr, "Could not open file '%s': %s\n", name, strerror(errno));
+			return 1;
+		}
+		size_t n = NELEMS(m);
+		while (n && !m[n - 1])
+			n--;
+		if (fwrite(m, sizeof m[0], n, f) != n || fclose(f) < 0) {
+			(void)fprintf(stderr, "unable to write '%s'\n", name);
+			return 1;
+		}
+		if (ops && printf("%s %"PRIu64"\n", benchmarks[i].name, ops) < 0)
+			return 1;
+	}
+	return 0;
+}
@@ -5,6 +5,7 @@
  * TODO: Misc: Forth/BIOS ROM, Device/Peripheral discovery/description table, debugging
  * TODO: Describe alternatives/Design decisions; ASCII-based 64-bit VM, simpler CPU, p-code machine */
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -13,6 +14,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "vm.h"
+#include "cache.h"
 
 typedef struct {
 	uint8_t buf[8192];
@@ -21,6 +24,22 @@ typedef struct {
 	int error;
 } network_t;
 
+#define HOSTFS_FILES (16ul)
+#define HOSTFS_PATH  (256ul)
+#define SHM_SIZE     (1024ull * 1024ull) /* size of a newly created shared memory object */
+#define SHM_MAX      (1024ull * 1024ull * 1024ull)
+
+typedef struct {
+	int dir, fd[HOSTFS_FILES]; /* host descriptors plus one, zero is closed */
+	uint64_t ring, entries, head, tail, issued, error; /* 'issued' requests are between 'head' and 'tail' */
+} hostfs_t;
+
+typedef struct {
+	uint8_t *base; /* host mapping of the shared memory object */
+	uint64_t size, kicks, notifies;
+	int in, out; /* notification descriptors plus one, zero if unused */
+} shm_t;
+
 #ifdef USE_NETWORKING
 #include <pcap.h>
 #define NETWORKING (1ull)
@@ -74,6 +93,46 @@ static int eth_poll(network_t *n) { assert(n); return -1; }
 static int eth_transmit(network_t *n) { assert(n); return -1; }
 #endif
 
+#ifdef USE_THREADS
+#include <pthread.h>
+#define THREADS (1ull)
+#define QUEUE_SIZE (1024ul) /* power of two */
+
+/* Lock free single producer, single consumer queue; only the consumer moves
+ * 'head' and only the producer 'tail', which are free running counts */
+typedef struct {
+	uint64_t item[QUEUE_SIZE];
+	uint64_t head, tail;
+} queue_t;
+
+/* Returns -1 if full, otherwise 1 if the queue was empty, so the consumer
+ * may need waking, and 0 if not */
+static int queue_push(queue_t *q, uint64_t x) {
+	assert(q);
+	const uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	const uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail - head >= QUEUE_SIZE)
+		return -1;
+	q->item[tail % QUEUE_SIZE] = x;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return tail == head;
+}
+
+static int queue_pop(queue_t *q, uint64_t *x) {
+	assert(q);
+	assert(x);
+	const uint64_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	const uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return -1;
+	*x = q->item[head % QUEUE_SIZE];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+#else
+#define THREADS (0ull)
+#endif
+
 #ifdef USE_GUI
 #include <SDL.h>
 #define GUI (1ull)
@@ -84,30 +143,38 @@ static int eth_transmit(network_t *n) { assert(n); return -1; }
 #ifdef __unix__
 #include <unistd.h>
 #include <termios.h>
-static struct termios oldattr, newattr;
+#include <poll.h>
+#define TERMINAL_FD (STDIN_FILENO)
+
+typedef struct {
+	struct termios attr; /* settings to restore */
+	int raw;
+} terminal_t;
 
-static void restore(void) {
-	tcsetattr(STDIN_FILENO, TCSANOW, &oldattr);
+static void restore(terminal_t *t) {
+	assert(t);
+	if (t->raw)
+		tcsetattr(STDIN_FILENO, TCSANOW, &t->attr);
+	t->raw = 0;
 }
 
-static int setup(void) {
-	tcgetattr(STDIN_FILENO, &oldattr);
-	newattr = oldattr;
-	newattr.c_iflag &= ~(ICRNL);
-	newattr.c_lflag &= ~(ICANON | ECHO);
-	newattr.c_cc[VMIN]  = 0;
-	newattr.c_cc[VTIME] = 0;
-	tcsetattr(STDIN_FILENO, TCSANOW, &newattr);
-	atexit(restore);
+static int setup(terminal_t *t) {
+	assert(t);
+	tcgetattr(STDIN_FILENO, &t->attr);
+	struct termios raw = t->attr;
+	raw.c_iflag &= ~(ICRNL);
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN]  = 0;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	t->raw = 1;
 	return 0;
 }
 
-static int getch(void) {
-	static int init = 0;
-	if (!init) {
-		setup();
-		init = 1;
-	}
+static int getch(terminal_t *t) {
+	assert(t);
+	if (!t->raw)
+		setup(t);
 	unsigned char r = 0;
 	if (read(STDIN_FILENO, &r, 1) != 1)
 		return -1;
@@ -123,34 +190,294 @@ static int putch(int c) {
 static void sleep_ms(unsigned ms) {
 	usleep((unsigned long)ms * 1000);
 }
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/* Block until there is input on any of 'fds', negative ones are ignored, or
+ * 'ms' milliseconds pass, forever if negative */
+static int wait_input(const int *fds, size_t n, int ms) {
+	assert(fds);
+	struct pollfd pfd[4];
+	assert(n <= sizeof pfd / sizeof pfd[0]);
+	for (size_t i = 0; i < n; i++)
+		pfd[i] = (struct pollfd) { .fd = fds[i], .events = POLLIN, };
+	return poll(pfd, n, ms) > 0;
+}
 #else
+#define TERMINAL_FD (-1)
+typedef struct { int raw; } terminal_t;
+static void restore(terminal_t *t) { assert(t); }
 #ifdef _WIN32
 
-extern int getch(void);
+extern int _getch(void);
 extern int putch(int c);
+static int getch(terminal_t *t) { assert(t); return _getch(); }
 static void sleep_ms(unsigned ms) {
 	usleep((unsigned long)ms * 1000);
 }
 #else
-static int getch(void) { return getchar(); }
+static int getch(terminal_t *t) { assert(t); return getchar(); }
 static int putch(const int c) { return putchar(c); }
 static void sleep_ms(unsigned ms) { (void)ms; }
 #endif
+static uint64_t now_ns(void) { return ((uint64_t)clock() * 1000000000ull) / CLOCKS_PER_SEC; }
+static int wait_input(const int *fds, size_t n, int ms) { (void)fds; (void)n; sleep_ms(ms < 0 ? 1 : ms); return 1; }
 #endif /** __unix__ **/
 
-static int wrap_getch(void) {
-	const int ch = getch();
-	if (ch == EOF) {
-		sleep_ms(1);
+static uint64_t now_ms(void) { return now_ns() / 1000000ull; }
+
+static int host_random(FILE **f, uint8_t *buf, size_t len) { /* opens '*f' on first use */
+	assert(f);
+	assert(buf);
+	if (!*f && !(*f = fopen("/dev/urandom", "rb")))
+		return -1;
+	return fread(buf, 1, len, *f) == len ? 0 : -1;
+}
+
+/* Host side of the file system passthrough device; a directory is exported
+ * and guest paths are resolved relative to it. Results are a byte count,
+ * handle or zero on success and a negated errno on failure. */
+enum { HF_READ = 1, HF_WRITE = 2, HF_CREATE = 4, HF_TRUNCATE = 8, };
+
+static int hostfs_path_ok(const char *path) { /* no absolute paths and no ".." components */
+	assert(path);
+	if (path[0] == '/' || path[0] == '\0')
+		return 0;
+	for (const char *p = path; *p; ) {
+		const size_t n = strcspn(p, "/");
+		if (n == 2 && p[0] == '.' && p[1] == '.')
+			return 0;
+		p += n;
+		p += *p == '/';
 	}
-	if (ch == 27)
-		exit(0);
-	return ch == 127 ? 8 : ch;
+	return 1;
+}
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static int hostfs_init(hostfs_t *h, const char *dir) {
+	assert(h);
+	assert(dir);
+	const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	h->dir = fd + 1;
+	return 0;
+}
+
+/* Open the directory holding the last component of 'path', one component
+ * at a time so that no symbolic link, to a directory or otherwise, leads
+ * out of the exported directory. Returns a descriptor or a negated errno. */
+static int hostfs_parent(hostfs_t *h, const char *path, const char **name) {
+	assert(h);
+	assert(path);
+	assert(name);
+	if (!hostfs_path_ok(path))
+		return -EACCES;
+	int dir = openat(h->dir - 1, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0)
+		return -errno;
+	char part[256];
+	for (size_t n = 0; path[n = strcspn(path, "/")] == '/'; path += n + 1) {
+		if (n >= sizeof part) {
+			(void)close(dir);
+			return -ENAMETOOLONG;
+		}
+		if (n == 0)
+			continue;
+		memcpy(part, path, n);
+		part[n] = '\0';
+		const int next = openat(dir, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		const int e = errno;
+		(void)close(dir);
+		if (next < 0)
+			return -e;
+		dir = next;
+	}
+	*name = path;
+	return dir;
+}
+
+static int64_t hostfs_open(hostfs_t *h, const char *path, uint64_t flags) {
+	assert(h);
+	assert(path);
+	size_t i = 0;
+	for (i = 0; i < HOSTFS_FILES && h->fd[i]; i++)
+		;
+	if (i == HOSTFS_FILES)
+		return -EMFILE;
+	int mode = (flags & HF_WRITE) ? ((flags & HF_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+	mode |= (flags & HF_CREATE ? O_CREAT : 0) | (flags & HF_TRUNCATE ? O_TRUNC : 0);
+	const char *name = NULL;
+	const int dir = hostfs_parent(h, path, &name);
+	if (dir < 0)
+		return dir;
+	const int fd = openat(dir, name, mode | O_NOFOLLOW | O_CLOEXEC, 0644);
+	const int e = errno;
+	(void)close(dir);
+	if (fd < 0)
+		return -e;
+	h->fd[i] = fd + 1;
+	return i;
+}
+
+static void hostfs_fini(hostfs_t *h) {
+	assert(h);
+	for (size_t i = 0; i < HOSTFS_FILES; i++)
+		if (h->fd[i])
+			(void)close(h->fd[i] - 1);
+	if (h->dir)
+		(void)close(h->dir - 1);
+	memset(h, 0, sizeof *h);
+}
+
+static int64_t hostfs_close(hostfs_t *h, int fd, uint64_t handle) {
+	assert(h);
+	h->fd[handle] = 0;
+	return close(fd) < 0 ? -errno : 0;
+}
+
+static int64_t hostfs_io(int fd, uint8_t *buf, uint64_t len, uint64_t offset, int write) {
+	assert(buf);
+	const ssize_t r = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+	return r < 0 ? -errno : r;
+}
+
+static int64_t hostfs_size(int fd) {
+	struct stat st;
+	return fstat(fd, &st) < 0 ? -errno : st.st_size;
+}
+
+static int64_t hostfs_remove(hostfs_t *h, const char *path) {
+	assert(h);
+	assert(path);
+	const char *name = NULL;
+	const int dir = hostfs_parent(h, path, &name);
+	if (dir < 0)
+		return dir;
+	const int64_t r = unlinkat(dir, name, 0) < 0 ? -errno : 0;
+	(void)close(dir);
+	return r;
+}
+#else
+static int hostfs_init(hostfs_t *h, const char *dir) { assert(h); assert(dir); return -1; }
+static void hostfs_fini(hostfs_t *h) { assert(h); }
+static int64_t hostfs_open(hostfs_t *h, const char *path, uint64_t flags) { (void)h; (void)path; (void)flags; return -ENOSYS; }
+static int64_t hostfs_close(hostfs_t *h, int fd, uint64_t handle) { (void)h; (void)fd; (void)handle; return -ENOSYS; }
+static int64_t hostfs_io(int fd, uint8_t *buf, uint64_t len, uint64_t offset, int write) { (void)fd; (void)buf; (void)len; (void)offset; (void)write; return -ENOSYS; }
+static int64_t hostfs_size(int fd) { (void)fd; return -ENOSYS; }
+static int64_t hostfs_remove(hostfs_t *h, const char *path) { (void)h; (void)path; return -ENOSYS; }
+#endif
+
+/* Shared memory channel; a POSIX shared memory object is mapped into guest
+ * physical memory so host processes can exchange data with the guest in
+ * place. Notifications are 8 byte counters written to and read from a pair
+ * of descriptors inherited from the parent, eventfds ideally, although pipes
+ * work too. */
+#ifdef __unix__
+#include <sys/mman.h>
+
+static int shm_init(shm_t *s, const char *name, uint64_t size) {
+	assert(s);
+	assert(name);
+	const int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto fail;
+	if (st.st_size == 0 && ftruncate(fd, size) < 0)
+		goto fail;
+	size = st.st_size ? (uint64_t)st.st_size : size;
+	size = size < SHM_MAX ? size : SHM_MAX;
+	size &= ~7ull;
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	(void)close(fd);
+	s->base = p;
+	s->size = size;
+	return 0;
+fail:
+	(void)close(fd);
+	return -1;
+}
+
+static void shm_fini(shm_t *s) { /* notification descriptors belong to the parent */
+	assert(s);
+	if (s->base)
+		(void)munmap(s->base, s->size);
+	s->base = NULL;
+	s->size = 0;
+}
+
+static int shm_notifiers(shm_t *s, int in, int out) {
+	assert(s);
+	if (in < 0 || out < 0 || fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK) < 0)
+		return -1;
+	s->in = in + 1;
+	s->out = out + 1;
+	return 0;
 }
 
-static int wrap_putch(const int ch) {
-	return putch(ch);
+static int shm_kick(shm_t *s) { /* notify the host */
+	assert(s);
+	const uint64_t one = 1;
+	if (!s->out)
+		return -1;
+	return write(s->out - 1, &one, sizeof one) == sizeof one ? 0 : -1;
+}
+
+static uint64_t shm_pending(shm_t *s) { /* number of notifications from the host */
+	assert(s);
+	uint64_t n = 0;
+	if (!s->in)
+		return 0;
+	uint64_t buf[8];
+	for (ssize_t r = 0; (r = read(s->in - 1, buf, sizeof buf)) > 0; )
+		for (size_t i = 0; i < (size_t)r / sizeof buf[0]; i++)
+			n += buf[i];
+	return n;
+}
+#else
+static int shm_init(shm_t *s, const char *name, uint64_t size) { assert(s); assert(name); (void)size; return -1; }
+static void shm_fini(shm_t *s) { assert(s); }
+static int shm_notifiers(shm_t *s, int in, int out) { assert(s); (void)in; (void)out; return -1; }
+static int shm_kick(shm_t *s) { assert(s); return -1; }
+static uint64_t shm_pending(shm_t *s) { assert(s); return 0; }
+#endif
+
+/* Guest RAM is reserved up front but only committed by the host as it is
+ * touched, so large memories cost nothing until they are used. */
+#ifdef __unix__
+static void *ram_alloc(uint64_t size, int huge) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (huge)
+		(void)madvise(p, size, MADV_HUGEPAGE);
+#else
+	(void)huge;
+#endif
+	return p;
+}
+
+static void ram_free(void *p, uint64_t size) {
+	if (p)
+		(void)munmap(p, size);
 }
+#else
+static void *ram_alloc(uint64_t size, int huge) { (void)huge; return size == (size_t)size ? calloc(size, 1) : NULL; }
+static void ram_free(void *p, uint64_t size) { (void)size; free(p); }
+#endif
 
 /* End of Peripherals - start of VM */
 
@@ -162,9 +489,104 @@ static inline int bit_xor(uint64_t *v, int bit) { assert(v); *v = *v ^  (1ull <<
 static inline int bit_clr(uint64_t *v, int bit) { assert(v); *v = *v & ~(1ull << bit); return 0; }
 static inline int bit_cnd(uint64_t *v, int bit, int set) { assert(v); return (set ? bit_set : bit_clr)(v, bit); }
 
+static inline uint64_t rotl(uint64_t v, unsigned n) { n &= 63; return n ? (v << n) | (v >> (64 - n)) : v; }
+static inline uint64_t rotr(uint64_t v, unsigned n) { n &= 63; return n ? (v >> n) | (v << (64 - n)) : v; }
+static inline uint64_t asr(uint64_t v, unsigned n) { n &= 63; return (v >> n) | ((v >> 63) && n ? ~(~0ull >> n) : 0); }
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+static inline uint64_t clz(uint64_t v) { return v ? __builtin_clzll(v) : 64; }
+static inline uint64_t ctz(uint64_t v) { return v ? __builtin_ctzll(v) : 64; }
+static inline uint64_t popcnt(uint64_t v) { return __builtin_popcountll(v); }
+#else
+#define ALWAYS_INLINE inline
+static inline uint64_t clz(uint64_t v) { uint64_t r = 0; for (uint64_t m = 1ull << 63; m && !(v & m); m >>= 1) r++; return r; }
+static inline uint64_t ctz(uint64_t v) { uint64_t r = 0; for (uint64_t m = 1ull; m && !(v & m); m <<= 1) r++; return r; }
+static inline uint64_t popcnt(uint64_t v) { uint64_t r = 0; for (; v; v &= v - 1) r++; return r; }
+#endif
+
+static inline uint64_t mulhu(uint64_t a, uint64_t b) { /* high 64 bits of 128-bit product */
+#ifdef __SIZEOF_INT128__
+	__extension__ typedef unsigned __int128 u128;
+	return ((u128)a * b) >> 64;
+#else
+	const uint64_t al = a & 0xFFFFFFFFull, ah = a >> 32, bl = b & 0xFFFFFFFFull, bh = b >> 32;
+	const uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	const uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFull) + (hl & 0xFFFFFFFFull);
+	return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+static inline uint64_t mulhs(uint64_t a, uint64_t b) {
+	uint64_t r = mulhu(a, b);
+	if (a >> 63) r -= b;
+	if (b >> 63) r -= a;
+	return r;
+}
+
+/* Packed operations treat a register as 8 x u8 or 4 x u16 lanes, lane 0
+ * being the least significant. Host SIMD is used where available. */
+static inline uint64_t hsum16(uint64_t a) {
+	a = (a & 0x0000FFFF0000FFFFull) + ((a >> 16) & 0x0000FFFF0000FFFFull);
+	return (a & 0xFFFFFFFFull) + (a >> 32);
+}
+
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#define SIMD(FN, A, B) ((uint64_t)_mm_cvtsi128_si64(FN(_mm_cvtsi64_si128((long long)(A)), _mm_cvtsi64_si128((long long)(B)))))
+static inline uint64_t addus8(uint64_t a, uint64_t b) { return SIMD(_mm_adds_epu8, a, b); }
+static inline uint64_t subus8(uint64_t a, uint64_t b) { return SIMD(_mm_subs_epu8, a, b); }
+static inline uint64_t addus16(uint64_t a, uint64_t b) { return SIMD(_mm_adds_epu16, a, b); }
+static inline uint64_t subus16(uint64_t a, uint64_t b) { return SIMD(_mm_subs_epu16, a, b); }
+static inline uint64_t cmpeq8(uint64_t a, uint64_t b) { return SIMD(_mm_cmpeq_epi8, a, b); }
+static inline uint64_t cmpeq16(uint64_t a, uint64_t b) { return SIMD(_mm_cmpeq_epi16, a, b); }
+static inline uint64_t hsum8(uint64_t a) { return SIMD(_mm_sad_epu8, a, 0); }
+#else
+static inline uint64_t lanes(uint64_t a, uint64_t b, unsigned bits, int op) {
+	const uint64_t mask = (1ull << bits) - 1ull;
+	uint64_t r = 0;
+	for (unsigned i = 0; i < 64; i += bits) {
+		const uint64_t x = (a >> i) & mask, y = (b >> i) & mask;
+		uint64_t z = 0;
+		switch (op) {
+		case 0: z = x + y > mask ? mask : x + y; break;
+		case 1: z = x > y ? x - y : 0; break;
+		case 2: z = x == y ? mask : 0; break;
+		}
+		r |= z << i;
+	}
+	return r;
+}
+static inline uint64_t addus8(uint64_t a, uint64_t b) { return lanes(a, b, 8, 0); }
+static inline uint64_t subus8(uint64_t a, uint64_t b) { return lanes(a, b, 8, 1); }
+static inline uint64_t addus16(uint64_t a, uint64_t b) { return lanes(a, b, 16, 0); }
+static inline uint64_t subus16(uint64_t a, uint64_t b) { return lanes(a, b, 16, 1); }
+static inline uint64_t cmpeq8(uint64_t a, uint64_t b) { return lanes(a, b, 8, 2); }
+static inline uint64_t cmpeq16(uint64_t a, uint64_t b) { return lanes(a, b, 16, 2); }
+static inline uint64_t hsum8(uint64_t a) { a = (a & 0x00FF00FF00FF00FFull) + ((a >> 8) & 0x00FF00FF00FF00FFull); return hsum16(a); }
+#endif
+
+static inline uint64_t shuf8(uint64_t a, uint64_t sel) { /* byte i = byte (sel[i] & 7) of a, or zero if sel[i] bit 7 set */
+	uint64_t r = 0;
+	for (unsigned i = 0; i < 64; i += 8) {
+		const uint64_t s = sel >> i;
+		if (!(s & 0x80ull))
+			r |= ((a >> ((s & 7ull) * 8ull)) & 0xFFull) << i;
+	}
+	return r;
+}
+
+static inline uint64_t zbyte(uint64_t a) { /* index of first zero byte, 8 if none */
+	const uint64_t t = (a - 0x0101010101010101ull) & ~a & 0x8080808080808080ull;
+	return t ? ctz(t) / 8ull : 8ull;
+}
+
 #define MEMORY_START (0x0000000080000000ull)
-#define MEMORY_END   (MEMORY_START + (sizeof (((vm_t) { .pc = 0 }).m)/ sizeof (uint64_t)))
-#define SIZE         (1024ul * 1024ul * 1ul)
+#define MEMORY_END(V) (MEMORY_START + (V)->msize)
+#define MEMORY_MAX   (1ull << 40)
+#define JOURNAL_MAGIC (0x314C4E524A4D56ull) /* "VMJRNL1" */
+#define DELTA_MAGIC  (0x31544C4544564Dull) /* "MVDELT1" */
+#define SIZE         (1024ul * 1024ul * 1ul) /* disk size and default RAM size */
 #define TLB_ENTRIES  (64ul)
 #define TRAPS        (32ul)
 #define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
@@ -172,28 +594,125 @@ static inline int bit_cnd(uint64_t *v, int bit, int set) { assert(v); return (se
 #define PAGE_MASK    (PAGE_SIZE - 1ull)
 #define IO_START     (0x0000000004000000ull)
 #define IO_END       (0x0000000008000000ull)
+#define SHM_START    (0x0000000040000000ull)
+#define KSEG_START   (0xFFFF000000000000ull)
 #define TLB_ADDR_MASK (0x0000FFFFFFFFFFFFull & ~PAGE_MASK)
 #define NELEMS(X)    (sizeof (X) / sizeof ((X)[0]))
+#define ASID_MASK    (PAGE_MASK) /* ASID is held in the page offset bits of a TLB entry */
 #define REGS         (16ul)
+#define SP           (REGS - 1ul) /* stack pointer used by call/ret/push/pop */
+#define SREGS        (16ul)
+#define IRQS         (32ul)
+#define UART_POLL    (1024ul) /* instructions between polls of the host for input */
+#define TICKS_PER_MS (100000ull) /* nominal guest speed used when the CPU is idle */
+#define MMIO_DEVICES (8ul)
+#define RV_TLB       (64ul) /* translations cached for each kind of access by the RISC-V core */
+#define HEAT_LINE    (64ul) /* bytes of RAM per heatmap counter */
+#define IO_WAIT_MS   (10) /* longest an I/O thread sleeps before checking its queue */
+#define LOOP_MAX     (16ul * sizeof (uint64_t)) /* longest loop considered for fast forwarding */
+
+typedef struct {
+	uint64_t head, tail, icount, effects, flags, r[REGS];
+	uint64_t len, visit, at[REGS], d[REGS]; /* iteration length, the registers at the head of the last and their change */
+	int tick, uart; /* set if the iteration read 'tick' or polled the UART for input */
+	int skip, probing, deltas; /* 'skip' to try fast forwarding a polling loop */
+} loop_t; /* state at the last short backwards jump, for idle loop detection */
+
+typedef struct {
+	FILE *f;
+	int mode, have; /* J_OFF, J_RECORD or J_REPLAY; 'have' if 'next' holds the next record */
+	uint64_t next[3]; /* instruction count, kind, value */
+} journal_t;
+
+typedef struct {
+	uint64_t *count; /* reads, writes and fetches for each HEAT_LINE of RAM, NULL if off */
+	uint64_t period, countdown, dumps; /* one access in 'period' is sampled */
+	const char *file;
+} heat_t;
+
+typedef struct {
+#ifdef USE_THREADS
+	queue_t tx, rx, requests, completions; /* console output and input, host file system descriptors */
+	pthread_t console, hostfs;
+	int wake_console[2], wake_hostfs[2], ready[2], space[2]; /* pipes to wake each thread, the idle CPU and a CPU waiting on output */
+	int stop;
+#endif
+	int on, terminal; /* threads running, the terminal served by one */
+} io_t;
+
+typedef struct {
+	unsigned page;
+	vm_read_t read;
+	vm_write_t write;
+	void *param;
+} mmio_t; /* host device registered through 'vm_mmio' */
 
 typedef struct {
-	uint64_t m[SIZE / sizeof (uint64_t)];
+	vm_getch_t getch;
+	vm_putch_t putch;
+	void *param;
+	terminal_t terminal; /* used for whichever of 'getch' and 'putch' are not set */
+} console_t; /* UART and HC_WRITE back end, set through 'vm_console' */
+
+typedef struct {
+	uint64_t x[32];
+	uint64_t mstatus, medeleg, mideleg, mie, mip, mtvec, mscratch, mepc, mcause, mtval;
+	uint64_t stvec, sscratch, sepc, scause, stval, satp;
+	uint64_t reservation; /* address reserved by a load reserved, plus one */
+	uint64_t mtime; /* the 'time' counter, advanced with 'tick' but never reset by the timer */
+	uint64_t tlb[3][RV_TLB][2]; /* virtual page plus one and physical page, for each of READ, WRITE and EXECUTE */
+	int priv;
+} rv_t; /* RISC-V core, used instead of the native one with '-R' */
+
+struct vm {
+	uint64_t *m, msize; /* RAM and its size in bytes */
+	uint64_t *touched, *dirty, snapshots; /* bitmaps of pages written since load and since the last snapshot */
+	const char *snapshot; /* snapshot file name prefix */
 	uint64_t pc, flags, timer, tick, tron;
-	uint64_t r[REGS];
+	uint64_t *r, bank[4][REGS]; /* 'r' points to the bank for the trap level */
+	uint64_t saved[4]; /* saved flags of each trap level, kept while a nested trap runs */
 	uint64_t traps[TRAPS];
-	uint64_t tlb_va[TLB_ENTRIES], tlb_pa[TLB_ENTRIES];
-	uint64_t disk[SIZE / sizeof (uint64_t)], dbuf[PAGE_SIZE], dstat, dp;
-	uint64_t uart_control, uart_rx, uart_tx;
+	uint64_t sreg[SREGS];
+	uint64_t tlb_va[TLB_ENTRIES], tlb_pa[TLB_ENTRIES], tlb_victim;
+	uint64_t tlb_pte[TLB_ENTRIES]; /* address of the page table entry an entry was walked from, or zero */
+	uint64_t disk[SIZE / sizeof (uint64_t)], dbuf[PAGE_SIZE / sizeof (uint64_t)], dstat, dp;
+	uint64_t uart_control, uart_rx, uart_tx, uart_buf, uart_ready;
+	uint64_t irq_pending, irq_enable, irq_threshold, irq_service, irq_priority[IRQS], poll;
 	uint64_t rtc_control, rtc_s, rtc_frac_s;
-	uint64_t loaded;
+	uint64_t loaded, icount, effects; /* instructions executed, stores and other side effects */
+	uint64_t hypercall, status; /* hypercalls enabled, exit status */
+	loop_t loop;
+	journal_t journal;
+	heat_t heat;
+	cache_sim_t sim;
+	FILE *access; /* access trace, see 'cache.h' */
+	FILE *random; /* host entropy for HC_RANDOM */
+	int profile, simulate; /* 'profile' if any of 'heat', 'sim' or 'access' are on */
+	io_t io;
+	console_t console;
 	network_t network;
-	int halt;
+	hostfs_t hostfs;
+	shm_t shm;
+	mmio_t mmio[MMIO_DEVICES];
+	rv_t rv;
+	int halt, wfi, fast, stop, retrace, riscv; /* 'retrace' ends the run loop so another can be picked */
 	FILE *trace;
-} vm_t;
-enum { READ, WRITE, EXECUTE };
-enum { V = 52, C, Z, N, /* saved flags -> */ SVIRT = 56, SPRIV, SINTR, /* privileged flags -> */INTR = 60, PRIV, VIRT };
-enum { T_GENERAL, T_ASSERT, T_IMPL, T_DIV0, T_INST, T_ADDR, T_ALIGN, T_PRIV, T_PROTECT, T_UNMAPPED, T_TIMER, };
-enum { TLB_BIT_IN_USE = 48, TLB_BIT_PRIVILEGED, TLB_BIT_ACCESSED, TLB_BIT_DIRTY, TLB_BIT_READ, TLB_BIT_WRITE, TLB_BIT_EXECUTE, };
+};
+enum { READ, WRITE, EXECUTE, UNPROFILED = 4, /* for the load of a read-modify-write */ };
+enum { SHADOW = 24, V = 52, C, Z, N, /* saved flags -> */ SVIRT = 56, SPRIV, SINTR, /* privileged flags -> */INTR = 60, PRIV, VIRT, WALK };
+enum { T_GENERAL, T_ASSERT, T_IMPL, T_DIV0, T_INST, T_ADDR, T_ALIGN, T_PRIV, T_PROTECT, T_UNMAPPED, T_TIMER, T_STACK, T_EXTERNAL, T_HYPERCALL, };
+enum { HC_WRITE, HC_CLOCK, HC_RANDOM, HC_EXIT, };
+enum { IRQ_NONE, IRQ_UART_RX, IRQ_DISK, IRQ_NIC, IRQ_HOSTFS, IRQ_SHM, };
+enum { HD_OP, HD_HANDLE, HD_OFFSET, HD_BUF, HD_LEN, HD_FLAGS, HD_RESULT, HD_WORDS = 8, };
+enum { FS_NOP, FS_OPEN, FS_CLOSE, FS_READ, FS_WRITE, FS_SIZE, FS_REMOVE, };
+enum { J_OFF, J_RECORD, J_REPLAY, };
+enum { J_GETCH, J_UART, J_RTC, J_CLOCK, J_RANDOM, J_HOSTFS, J_SHM, J_DOZE, J_DATA, };
+enum { SR_STACK_LO, SR_STACK_HI, SR_PTBR, SR_ASID, };
+enum { RV_U, RV_S, RV_M = 3, };
+enum { RV_SIE = 1, RV_MIE = 3, RV_SPIE = 5, RV_MPIE = 7, RV_SPP = 8, RV_MPP = 11, RV_MPRV = 17, RV_SUM, RV_MXR, RV_TVM, RV_TW, RV_TSR, };
+enum { RV_SSI = 1, RV_MSI = 3, RV_STI = 5, RV_MTI = 7, RV_SEI = 9, RV_MEI = 11, };
+enum { PTE_V, PTE_R, PTE_W, PTE_X, PTE_U, PTE_G, PTE_A, PTE_D, };
+enum { TLB_BIT_IN_USE = 48, TLB_BIT_PRIVILEGED, TLB_BIT_ACCESSED, TLB_BIT_DIRTY, TLB_BIT_READ, TLB_BIT_WRITE, TLB_BIT_EXECUTE, TLB_BIT_SIZE, /* 2 bits */ TLB_BIT_GLOBAL = 57, };
 
 static int trace(vm_t *v, const char *fmt, ...) {
 	assert(v);
@@ -214,28 +733,255 @@ static int trace(vm_t *v, const char *fmt, ...) {
 	return r1 + 1;
 }
 
+/* Record writes to physical memory at 'addr' for 'len' bytes, 'len' not 0 */
+static inline void dirty_mark(vm_t *v, uint64_t addr, uint64_t len) {
+	assert(v);
+	assert(len);
+	const uint64_t last = (addr - MEMORY_START + len - 1ull) / PAGE_SIZE;
+	for (uint64_t pg = (addr - MEMORY_START) / PAGE_SIZE; pg <= last; pg++) {
+		v->touched[pg / 64ull] |= 1ull << (pg % 64ull);
+		v->dirty[pg / 64ull] |= 1ull << (pg % 64ull);
+	}
+}
+
+static uint64_t bitmap_size(vm_t *v) { assert(v); return (((v->msize / PAGE_SIZE) + 63ull) / 64ull) * sizeof (uint64_t); }
+
+static inline int page_get(const uint64_t *map, uint64_t pg) { return bit_get(map[pg / 64ull], pg % 64ull); }
+
+/* Record and replay. Every input from the host that the guest can observe
+ * is logged, when recording, with the instruction count at which it arrived.
+ * When replaying, the host is never consulted and inputs come from the log
+ * instead, so a run repeats exactly. Synchronous inputs, such as a polled
+ * read of the UART, the RTC or a host file system request, must be next in
+ * the log; asynchronous ones, such as an interrupt from the UART or time
+ * passing while idle, are only taken if they are next in the log and were
+ * recorded at the current instruction count. Bulk data follows its record as
+ * a J_DATA record giving its length. A run that diverges from the log, or
+ * reaches its end at a synchronous input, halts. */
+static inline int replaying(vm_t *v) { assert(v); return v->journal.mode == J_REPLAY; }
+
+static int journal_peek(vm_t *v) {
+	assert(v);
+	journal_t *j = &v->journal;
+	if (!j->have && fread(j->next, 1, sizeof j->next, j->f) == sizeof j->next)
+		j->have = 1;
+	return j->have;
+}
+
+static void journal_write(vm_t *v, uint64_t kind, uint64_t value) {
+	assert(v);
+	const uint64_t r[3] = { v->icount, kind, value, };
+	if (fwrite(r, 1, sizeof r, v->journal.f) != sizeof r)
+		v->halt = -3;
+}
+
+static uint64_t journal(vm_t *v, uint64_t kind, uint64_t value) {
+	assert(v);
+	journal_t *j = &v->journal;
+	if (j->mode == J_RECORD)
+		journal_write(v, kind, value);
+	if (j->mode != J_REPLAY)
+		return value;
+	if (!journal_peek(v)) {
+		(void)fprintf(stderr, "replay: end of journal at %"PRIu64"\n", v->icount);
+		v->halt = 1;
+		return 0;
+	}
+	if (j->next[0] != v->icount || j->next[1] != kind) {
+		(void)fprintf(stderr, "replay: diverged at %"PRIu64", expected %"PRIu64" at %"PRIu64"\n", v->icount, j->next[1], j->next[0]);
+		v->halt = -3;
+		return 0;
+	}
+	j->have = 0;
+	return j->next[2];
+}
+
+static int journal_event(vm_t *v, uint64_t kind, uint64_t *value) {
+	assert(v);
+	assert(value);
+	journal_t *j = &v->journal;
+	if (!journal_peek(v) || j->next[0] != v->icount || j->next[1] != kind)
+		return 0;
+	j->have = 0;
+	*value = j->next[2];
+	return 1;
+}
+
+static void journal_data(vm_t *v, void *buf, uint64_t len) {
+	assert(v);
+	assert(buf);
+	if (v->journal.mode == J_OFF)
+		return;
+	if (journal(v, J_DATA, len) != len)
+		return;
+	journal_t *j = &v->journal;
+	if ((j->mode == J_RECORD ? fwrite(buf, 1, len, j->f) : fread(buf, 1, len, j->f)) != len)
+		v->halt = -3;
+}
+
+/* Point 'r' at the bank for the trap level if shadow registers are on, else
+ * at the first, returning non zero if that changed it. */
+static int bank_select(vm_t *v) {
+	assert(v);
+	uint64_t *r = v->bank[bit_get(v->flags, SHADOW) ? (uint8_t)v->flags % 4 : 0];
+	const int changed = r != v->r;
+	v->r = r;
+	return changed;
+}
+
 static int trap(vm_t *v, uint64_t addr, uint64_t val) {
 	assert(v);
 	if (trace(v, "+trap,%"PRIx64",%"PRIx64",%"PRIx64",", v->flags, addr, val) < 0)
 		return -1;
+	v->effects++;
 	uint8_t level = v->flags;
 	const uint64_t a = v->flags >> 8;
 	const uint64_t b = v->flags >> 16;
 	if (level > 2) { v->halt = -1; return -1; }
+	v->saved[level] = v->flags & (0x0F0Full << 48);
 	level++;
 	v->flags &= 0xF0F0FFFFFFFFFF00ull; /* clear saved flags */
 	v->flags |= level;
 	const uint64_t f = v->flags & (0xF0F0ull << 48);
 	v->flags |= (f >> 4);
+	(void)bank_select(v); /* switch to the shadow bank for this level */
 	v->r[a % REGS] = v->pc;
 	v->r[b % REGS] = val;
 	bit_set(&v->flags, PRIV);   /* escalate privilege level */
+	bit_set(&v->flags, INTR);   /* and mask interrupts until trap return */
 	if (addr >= NELEMS(v->traps))
 		addr = T_ADDR;
 	v->pc = v->traps[addr];
 	return 1;
 }
 
+/* Undo a trap: restore the saved flags, drop a trap level, bring back the
+ * flags saved for that level and, if shadow registers are in use, switch back
+ * to the bank of the interrupted code. */
+static int trap_return(vm_t *v) {
+	assert(v);
+	if (bit_get(v->flags, PRIV) == 0)
+		return trap(v, T_PRIV, v->pc);
+	uint8_t level = v->flags;
+	if (level == 0)
+		return trap(v, T_INST, v->pc);
+	level--;
+	const uint64_t f = v->flags & (0x0F0Full << 48);
+	v->flags &= ~(0xFFFFull << 48) & ~0xFFull;
+	v->flags |= (f << 4) | v->saved[level % 4] | level;
+	(void)bank_select(v);
+	return 0;
+}
+
+/* The size field of a TLB entry selects a page of 8 KiB, 8 MiB, 8 GiB or 8
+ * TiB, the span of one entry at each level of the page table. */
+static inline uint64_t tlb_page_mask(uint64_t tva) {
+	return (1ull << (13 + (10 * ((tva >> TLB_BIT_SIZE) & 3ull)))) - 1ull;
+}
+
+/* Entries match if the tag matches and they are either global or belong to
+ * the current address space, SR_ASID. */
+static inline int tlb_match(vm_t *v, uint64_t tva, uint64_t vaddr) {
+	assert(v);
+	if (((tva ^ vaddr) & TLB_ADDR_MASK & ~tlb_page_mask(tva)) != 0)
+		return 0;
+	return bit_get(tva, TLB_BIT_GLOBAL) || ((tva ^ v->sreg[SR_ASID]) & ASID_MASK) == 0;
+}
+
+/* The first write through an entry the walker filled sets the dirty bit in
+ * its page table entry as well, if that is still valid, as the guest cannot
+ * read the TLB to find it there. */
+static void tlb_dirty(vm_t *v, size_t i) {
+	assert(v);
+	assert(i < NELEMS(v->tlb_pte));
+	const uint64_t pa = v->tlb_pte[i];
+	if (!pa || !within(pa, MEMORY_START, MEMORY_END(v)))
+		return;
+	uint64_t *pte = &v->m[(pa - MEMORY_START) / sizeof (uint64_t)];
+	if (bit_get(*pte, TLB_BIT_IN_USE) == 0)
+		return;
+	bit_set(pte, TLB_BIT_DIRTY);
+	dirty_mark(v, pa, sizeof *pte);
+}
+
+static int tlb_hit(vm_t *v, size_t i, uint64_t vaddr, uint64_t *paddr, int rwx) {
+	assert(v);
+	assert(paddr);
+	assert(i < NELEMS(v->tlb_va));
+	const uint64_t tva = v->tlb_va[i];
+	if (bit_get(v->flags, PRIV) == 0)
+		if (bit_get(tva, TLB_BIT_PRIVILEGED))
+			return trap(v, T_PROTECT, vaddr);
+	int bit = 0;
+	switch (rwx) {
+	case READ:     bit = TLB_BIT_READ;    break;
+	case WRITE:    bit = TLB_BIT_WRITE;   break;
+	case EXECUTE:  bit = TLB_BIT_EXECUTE; break;
+	}
+	if (bit_get(tva, bit) == 0)
+		return trap(v, T_PROTECT, vaddr);
+	bit_set(&v->tlb_va[i], TLB_BIT_ACCESSED);
+	if (rwx == WRITE && bit_get(tva, TLB_BIT_DIRTY) == 0) {
+		bit_set(&v->tlb_va[i], TLB_BIT_DIRTY);
+		tlb_dirty(v, i);
+	}
+	const uint64_t mask = tlb_page_mask(tva);
+	*paddr = (v->tlb_pa[i] & TLB_ADDR_MASK & ~mask) | (vaddr & mask);
+	return 0;
+}
+
+static size_t tlb_victim(vm_t *v) {
+	assert(v);
+	for (size_t i = 0; i < NELEMS(v->tlb_va); i++)
+		if (bit_get(v->tlb_va[i], TLB_BIT_IN_USE) == 0)
+			return i;
+	return v->tlb_victim++ % NELEMS(v->tlb_va);
+}
+
+/* Optional hardware page table walk, enabled with the WALK flag, instead of
+ * trapping on every TLB miss. SR_PTBR holds the physical address of the top
+ * level table. Tables are one page of 1024 entries, four levels each index
+ * 10 bits of the virtual page number (the top level only 5). Entries use the
+ * TLB bit layout with the physical address in bits 13-47; a valid entry with
+ * none of the read, write or execute bits set points to the next level
+ * table, otherwise it is a leaf, and a leaf above the bottom level maps a
+ * superpage of the whole span of that entry. Only invalid entries trap, to
+ * T_UNMAPPED as before. The walker sets the accessed bit of the leaf and the
+ * dirty bit on the first write through it. */
+static int tlb_walk(vm_t *v, uint64_t vaddr, int rwx, size_t *index) {
+	assert(v);
+	assert(index);
+	const uint64_t leaf = (1ull << TLB_BIT_READ) | (1ull << TLB_BIT_WRITE) | (1ull << TLB_BIT_EXECUTE);
+	uint64_t table = v->sreg[SR_PTBR] & TLB_ADDR_MASK, pte = 0, pa = 0;
+	for (int level = 3; ; level--) {
+		pa = table + (((vaddr >> (13 + (10 * level))) & 0x3FFull) * sizeof (uint64_t));
+		if (!within(pa, MEMORY_START, MEMORY_END(v)))
+			return trap(v, T_UNMAPPED, vaddr);
+		pte = v->m[(pa - MEMORY_START) / sizeof (uint64_t)];
+		if (bit_get(pte, TLB_BIT_IN_USE) == 0)
+			return trap(v, T_UNMAPPED, vaddr);
+		if (pte & leaf) {
+			pte &= ~(3ull << TLB_BIT_SIZE);
+			pte |= ((uint64_t)level << TLB_BIT_SIZE);
+			break;
+		}
+		if (level == 0)
+			return trap(v, T_UNMAPPED, vaddr);
+		table = pte & TLB_ADDR_MASK;
+	}
+	bit_set(&pte, TLB_BIT_ACCESSED);
+	if (rwx == WRITE && bit_get(pte, TLB_BIT_WRITE))
+		bit_set(&pte, TLB_BIT_DIRTY);
+	v->m[(pa - MEMORY_START) / sizeof (uint64_t)] = pte;
+	dirty_mark(v, pa, sizeof pte);
+	const size_t i = tlb_victim(v);
+	v->tlb_va[i] = (vaddr & TLB_ADDR_MASK & ~tlb_page_mask(pte)) | (pte & ~0x0000FFFFFFFFFFFFull) | (v->sreg[SR_ASID] & ASID_MASK);
+	v->tlb_pa[i] = pte & TLB_ADDR_MASK;
+	v->tlb_pte[i] = pa;
+	*index = i;
+	return 0;
+}
+
 /* NB. It might be better to start off with a large page size, so everything
  * can be stored within the TLB without fault. */
 static int tlb_lookup(vm_t *v, uint64_t vaddr, uint64_t *paddr, int rwx) {
@@ -243,31 +989,21 @@ static int tlb_lookup(vm_t *v, uint64_t vaddr, uint64_t *paddr, int rwx) {
 	assert(paddr);
 
 	BUILD_BUG_ON(sizeof (v->tlb_va) != sizeof (v->tlb_pa));
-	const uint64_t lo = vaddr & TLB_ADDR_MASK;
-
 	*paddr = 0;
 	for (size_t i = 0; i < NELEMS(v->tlb_va); i++) {
 		const uint64_t tva = v->tlb_va[i];
-		const uint64_t pva = v->tlb_pa[i];
 		if (bit_get(tva, TLB_BIT_IN_USE) == 0)
 			continue;
-		if (lo & (TLB_ADDR_MASK & tva))
+		if (!tlb_match(v, tva, vaddr))
 			continue;
-		if (bit_get(v->flags, PRIV))
-			if (bit_get(tva, TLB_BIT_PRIVILEGED) == 0)
-				return trap(v, T_PROTECT, vaddr);
-		int bit = 0;
-		switch (rwx) {
-		case READ:     bit = TLB_BIT_READ;    break;
-		case WRITE:    bit = TLB_BIT_WRITE;   break;
-		case EXECUTE:  bit = TLB_BIT_EXECUTE; break;
-		}
-		if (bit_get(tva, bit) == 0)
-			return trap(v, T_PROTECT, vaddr);
-		bit_set(&v->tlb_va[i], TLB_BIT_ACCESSED);
-		if (rwx == WRITE)
-			bit_set(&v->tlb_va[i], TLB_BIT_DIRTY);
-		*paddr = pva;
+		return tlb_hit(v, i, vaddr, paddr, rwx);
+	}
+	if (bit_get(v->flags, WALK) && !v->loop.probing) { /* a walk writes memory, so a probe must not */
+		size_t i = 0;
+		const int r = tlb_walk(v, vaddr, rwx, &i);
+		if (r)
+			return r;
+		return tlb_hit(v, i, vaddr, paddr, rwx);
 	}
 	/* The MIPs way is to throw an exception and let the software
 	 * deal with the problem, the fault handler cannot throw memory
@@ -275,16 +1011,38 @@ static int tlb_lookup(vm_t *v, uint64_t vaddr, uint64_t *paddr, int rwx) {
 	return trap(v, T_UNMAPPED, vaddr);
 }
 
+static void profile_record(vm_t *v, unsigned kind, uint64_t vaddr, uint64_t paddr) {
+	assert(v);
+	if (v->simulate)
+		cache_sim_access(&v->sim, kind, vaddr, paddr);
+	if (v->access) {
+		const uint64_t record[] = { (vaddr & ~7ull) | (kind & 7u), (paddr & ~7ull) | (kind >> 3), };
+		if (fwrite(record, 1, sizeof record, v->access) != sizeof record) {
+			(void)fclose(v->access);
+			v->access = NULL;
+			v->halt = -2;
+		}
+	}
+}
+
+/* The modelled TLB has no address space identifiers, so it is flushed
+ * whenever the guest flushes any entries or changes address space */
+static void profile_flush(vm_t *v, uint64_t vaddr, int all) {
+	assert(v);
+	if (v->profile)
+		profile_record(v, CACHE_FLUSH | (all ? CACHE_VIRTUAL : 0), vaddr, 0);
+}
+
 static int tlb_flush_single(vm_t *v, uint64_t vaddr, uint64_t *found) {
 	assert(v);
 	assert(found);
 	*found = 0;
 	if (bit_get(v->flags, PRIV) == 0)
 		return trap(v, T_PRIV, vaddr);
+	profile_flush(v, vaddr, 0);
 	BUILD_BUG_ON(sizeof (v->tlb_va) != sizeof (v->tlb_pa));
-	vaddr &= TLB_ADDR_MASK;
 	for (size_t i = 0; i < NELEMS(v->tlb_va); i++)
-		if (vaddr == (v->tlb_va[i] & TLB_ADDR_MASK)) {
+		if (bit_get(v->tlb_va[i], TLB_BIT_IN_USE) && tlb_match(v, v->tlb_va[i], vaddr)) {
 			bit_clr(&v->tlb_va[i], TLB_BIT_IN_USE);
 			*found = 1;
 			return 0;
@@ -292,10 +1050,22 @@ static int tlb_flush_single(vm_t *v, uint64_t vaddr, uint64_t *found) {
 	return 0;
 }
 
+static int tlb_flush_asid(vm_t *v, uint64_t asid) {
+	assert(v);
+	if (bit_get(v->flags, PRIV) == 0)
+		return trap(v, T_PRIV, asid);
+	profile_flush(v, 0, 1);
+	for (size_t i = 0; i < NELEMS(v->tlb_va); i++)
+		if (bit_get(v->tlb_va[i], TLB_BIT_GLOBAL) == 0 && ((v->tlb_va[i] ^ asid) & ASID_MASK) == 0)
+			bit_clr(&v->tlb_va[i], TLB_BIT_IN_USE);
+	return 0;
+}
+
 static int tlb_flush_all(vm_t *v) {
 	assert(v);
 	if (bit_get(v->flags, PRIV) == 0)
 		return trap(v, T_PRIV, 0);
+	profile_flush(v, 0, 1);
 	memset(v->tlb_va, 0, sizeof v->tlb_va);
 	memset(v->tlb_pa, 0, sizeof v->tlb_va);
 	return 0;
@@ -303,74 +1073,784 @@ static int tlb_flush_all(vm_t *v) {
 
 #define IO(X, Y) ((((uint64_t)(X)) * (PAGE_SIZE / sizeof (uint64_t))) + (uint64_t)(Y))
 
-static int load_phy(vm_t *v, uint64_t addr, uint64_t *val) {
+/* Interrupt controller; each source has an enable bit, a pending bit and a
+ * priority. The highest priority source that is pending, enabled, not in
+ * service and above the threshold causes a T_EXTERNAL trap. The handler
+ * claims the source by reading IO(5, 3), which returns its number (or zero)
+ * and marks it as in service, and writes the number back to IO(5, 3) to
+ * complete it. */
+static void irq_raise(vm_t *v, unsigned irq) {
 	assert(v);
-	assert(val);
-	*val = 0;
-	if (addr & 7ull)
-		return trap(v, T_ALIGN, v->pc);
+	assert(irq < IRQS);
+	bit_set(&v->irq_pending, irq);
+}
 
-	if (within(addr, MEMORY_START, MEMORY_END)) {
-		addr -= MEMORY_START;
-		addr /= sizeof (uint64_t);
-		*val = v->m[addr];
-		return 0;
+static unsigned irq_next(vm_t *v) {
+	assert(v);
+	uint64_t ready = v->irq_pending & v->irq_enable & ~v->irq_service & ~1ull;
+	unsigned best = IRQ_NONE;
+	for (; ready; ready &= ready - 1) {
+		const unsigned irq = ctz(ready);
+		if (v->irq_priority[irq] > v->irq_threshold && (best == IRQ_NONE || v->irq_priority[irq] > v->irq_priority[best]))
+			best = irq;
 	}
+	return best;
+}
 
-	if (within(addr, IO_START, IO_END)) {
-		addr -= IO_START;
-		addr /= sizeof (uint64_t);
-		switch (addr) {
-		/* PAGE 0 = Info */
-		case IO(0, 0): *val = 1; /* version */ return 0;
-		case IO(0, 1): *val = sizeof (uint64_t); return 0;
-		case IO(0, 2): *val = NELEMS(v->tlb_va); return 0;
-		case IO(0, 3): *val = PAGE_SIZE; return 0;
-		case IO(0, 4): *val = TRAPS; return 0;
-		case IO(0, 5): *val = 0x3; return 0; /* available I/O:  UART + DISK available */ 
-		/* PAGE 1 = Basic system registers */
-		case IO(1, 0): *val = v->halt; return 0;
-		case IO(1, 1): *val = v->tron; return 0;
-		case IO(1, 2): *val = v->tick; return 0;
-		case IO(1, 3): *val = v->timer; return 0;
-		case IO(1, 4): *val = v->rtc_control; return 0;
-		case IO(1, 5): *val = v->rtc_s; return 0;
-		case IO(1, 6): *val = v->rtc_frac_s; return 0;
-		/* PAGE 2 = UART */
-		case IO(2, 0): *val = 0x4; /* bit 3 = RX queue not empty, bit 5 = TX queue not empty */ return 0;
-		case IO(2, 1): *val = v->uart_rx; return 0;
-		case IO(2, 2): *val = v->uart_rx; return 0;
-		/* PAGE 3 = Disk Control */
-		case IO(3, 0): *val = v->dstat; return 0;
-		case IO(3, 1): 
-			bit_clr(&v->dstat, 0); /* never busy */
-			bit_clr(&v->dstat, 1); /* do operation always reads 0 */
-			*val = v->dstat & 0x1Full;
-			return 0;
+static unsigned irq_claim(vm_t *v) {
+	assert(v);
+	const unsigned irq = irq_next(v);
+	if (irq != IRQ_NONE) {
+		bit_clr(&v->irq_pending, irq);
+		bit_set(&v->irq_service, irq);
+	}
+	return irq;
+}
+
+/* Host I/O threads, built with USE_THREADS on unix and enabled with '-T'.
+ * The console and host file system back ends then run on threads of their
+ * own and talk to the CPU thread through lock free single producer, single
+ * consumer queues. Results are collected, and interrupts raised, between
+ * instructions. A thread is woken through a pipe when its queue was empty
+ * and checks it every IO_WAIT_MS regardless; the 'ready' pipe wakes an
+ * idle CPU when there is something for it, and the 'space' pipe a CPU
+ * blocked on a full console queue once it has been emptied. */
+#ifdef USE_THREADS
+static void io_wake(int fd) {
+	const char c = 0;
+	if (write(fd, &c, 1) < 0) { /* pipe full, a wake up is already pending */ }
+}
+
+static void io_drain(int fd) {
+	char buf[64];
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+}
+
+static void io_putch(vm_t *v, int ch) {
+	assert(v);
+	io_t *io = &v->io;
+	int r = 0;
+	while ((r = queue_push(&io->tx, (uint8_t)ch)) < 0) {
+		io_wake(io->wake_console[1]);
+		struct pollfd pfd = { .fd = io->space[0], .events = POLLIN, };
+		if (poll(&pfd, 1, IO_WAIT_MS) > 0)
+			io_drain(io->space[0]);
+	}
+	if (r)
+		io_wake(io->wake_console[1]);
+}
+
+static int io_getch(vm_t *v) {
+	assert(v);
+	uint64_t ch = 0;
+	if (queue_pop(&v->io.rx, &ch) < 0)
+		return EOF;
+	return (int)ch;
+}
+
+static int io_ready(vm_t *v) { assert(v); return v->io.on ? v->io.ready[0] : -1; }
+
+static int io_request(vm_t *v, uint64_t addr) {
+	assert(v);
+	io_t *io = &v->io;
+	if (v->hostfs.issued - v->hostfs.head >= QUEUE_SIZE)
+		return -1;
+	const int r = queue_push(&io->requests, addr);
+	if (r > 0)
+		io_wake(io->wake_hostfs[1]);
+	return r < 0 ? -1 : 0;
+}
+#else
+static void io_drain(int fd) { (void)fd; }
+static int io_ready(vm_t *v) { assert(v); return -1; }
+static void io_putch(vm_t *v, int ch) { assert(v); (void)ch; }
+static int io_getch(vm_t *v) { assert(v); return EOF; }
+static int io_request(vm_t *v, uint64_t addr) { assert(v); (void)addr; return -1; }
+#endif
+
+static int io_wanted(vm_t *v) { assert(v); return v->io.on && v->hostfs.issued != v->hostfs.head; }
+
+static int console_getch(vm_t *v) { /* EOF if nothing is waiting */
+	assert(v);
+	console_t *c = &v->console;
+	if (v->io.terminal)
+		return io_getch(v);
+	return c->getch ? c->getch(c->param) : getch(&c->terminal);
+}
+
+static int console_putch(vm_t *v, int ch) {
+	assert(v);
+	console_t *c = &v->console;
+	if (v->io.terminal) {
+		io_putch(v, ch);
+		return (unsigned char)ch; /* as 'putchar' */
+	}
+	return c->putch ? c->putch(c->param, ch) : putch(ch);
+}
+
+static int console_fd(vm_t *v) { /* descriptor to wait on for input, if there is one */
+	assert(v);
+	return v->io.terminal || v->console.getch ? -1 : TERMINAL_FD;
+}
+
+static int wrap_getch(vm_t *v) {
+	assert(v);
+	const int ch = console_getch(v);
+	if (ch == EOF) {
+		sleep_ms(1);
+	}
+	return ch == 127 ? 8 : ch;
+}
+
+static void shm_poll(vm_t *v) {
+	assert(v);
+	uint64_t n = 0;
+	if (replaying(v))
+		(void)journal_event(v, J_SHM, &n);
+	else if ((n = shm_pending(&v->shm)))
+		(void)journal(v, J_SHM, n);
+	if (n) {
+		v->shm.notifies += n;
+		irq_raise(v, IRQ_SHM);
+	}
+}
+
+static void uart_poll(vm_t *v) {
+	assert(v);
+	if (v->uart_ready)
+		return;
+	uint64_t ch = 0;
+	if (replaying(v)) {
+		if (!journal_event(v, J_UART, &ch))
+			return;
+	} else {
+		const int c = console_getch(v);
+		if (c == EOF)
+			return;
+		ch = journal(v, J_UART, c == 127 ? 8 : c);
+	}
+	if (ch == 27) {
+		v->halt = 1;
+		return;
+	}
+	v->uart_buf = ch;
+	v->uart_ready = 1;
+	irq_raise(v, IRQ_UART_RX);
+}
+
+static int uart_getch(vm_t *v) {
+	assert(v);
+	const int ch = (int)journal(v, J_GETCH, replaying(v) ? 0 : (uint64_t)wrap_getch(v));
+	if (ch == 27)
+		v->halt = 1;
+	return ch;
+}
+
+/* Host input sources are only polled if their interrupt is enabled, the
+ * UART also being usable without interrupts by polling IO(2, 0) */
+static int uart_wanted(vm_t *v) { assert(v); return bit_get(v->irq_enable, IRQ_UART_RX) && !v->uart_ready; }
+static int shm_wanted(vm_t *v) { assert(v); return bit_get(v->irq_enable, IRQ_SHM) && v->shm.in; }
+
+static void input_poll(vm_t *v) {
+	assert(v);
+	if (uart_wanted(v))
+		uart_poll(v);
+	if (shm_wanted(v))
+		shm_poll(v);
+}
+
+/* Sleep the host for up to 'ticks' of guest time, waking early on any
+ * wanted host input, or any console input if 'console' is set, returning the
+ * guest time that passed rounded down to a multiple of 'quantum'. A console
+ * without a descriptor to wait on is polled every millisecond instead. */
+static uint64_t doze(vm_t *v, uint64_t ticks, uint64_t quantum, int console) {
+	assert(v);
+	assert(quantum);
+	const uint64_t ms = ticks / TICKS_PER_MS;
+	const int uart = uart_wanted(v) || console, shm = shm_wanted(v);
+	const int polled = uart && console_fd(v) < 0 && !v->io.terminal;
+	const int timeout = polled && ms > 0 ? 1 : ticks == UINT64_MAX ? -1 : ms > INT_MAX ? INT_MAX : (int)ms;
+	if (replaying(v)) {
+		const uint64_t elapsed = journal(v, J_DOZE, 0);
+		input_poll(v);
+		return elapsed;
+	}
+	const uint64_t start = now_ms();
+	const int fds[] = { uart ? console_fd(v) : -1, shm ? v->shm.in - 1 : -1, io_ready(v), };
+	if (uart || shm || v->io.on ? wait_input(fds, NELEMS(fds), timeout) || polled : (sleep_ms(timeout), 0)) {
+		uint64_t elapsed = (now_ms() - start) * TICKS_PER_MS;
+		elapsed = elapsed < ticks ? elapsed : ticks;
+		elapsed = journal(v, J_DOZE, elapsed - (elapsed % quantum));
+		if (v->io.on)
+			io_drain(io_ready(v));
+		input_poll(v);
+		return elapsed;
+	}
+	return journal(v, J_DOZE, ticks);
+}
+
+/* Busy wait loops are skipped over. A loop is idle if, at the same short
+ * backwards jump, all registers and flags are identical to the previous
+ * iteration with no store, trap or other side effect in between; it will
+ * then repeat exactly until an interrupt arrives, or console input if it
+ * polls the UART. Guest time is advanced by whole iterations up to the
+ * timer deadline, so 'tick' and the point at which the timer fires are the
+ * same as if every iteration was executed, while the host sleeps for the
+ * equivalent time. A loop that reads 'tick' changes registers each time
+ * around, it is handed to 'loop_skip' once the jump is done. */
+static void loop_check(vm_t *v, uint64_t target) {
+	assert(v);
+	loop_t *l = &v->loop;
+	if (l->probing)
+		return;
+	const uint64_t len = v->icount - l->icount;
+	const int same = len && l->head == target && l->tail == v->pc && l->effects == v->effects && l->flags == v->flags;
+	if (same && !memcmp(l->r, v->r, sizeof l->r)) {
+		const int interrupt = bit_get(v->flags, INTR) == 0 && (v->timer || uart_wanted(v) || shm_wanted(v) || io_wanted(v));
+		if (interrupt || l->uart) {
+			const uint64_t remaining = v->timer ? (v->timer > v->tick ? v->timer - v->tick : 0) : UINT64_MAX;
+			const uint64_t skip = doze(v, remaining - (remaining % len), len, l->uart);
+			v->tick += skip;
+			v->rv.mtime += skip;
+			v->icount += skip;
+		}
+	} else {
+		l->skip = same && l->tick && len == l->len && bit_get(v->tron, 0) == 0;
+	}
+	l->head = target;
+	l->tail = v->pc;
+	l->len = len;
+	l->icount = v->icount;
+	l->effects = v->effects;
+	l->flags = v->flags;
+	l->tick = 0;
+	l->uart = 0;
+	memcpy(l->r, v->r, sizeof l->r);
+}
+
+/* A delta holds only the pages set in a bitmap, as a header of DELTA_MAGIC
+ * and the page size followed by records of a page address, as an offset into
+ * RAM, and the page contents. Applied in order to a base image, a series of
+ * deltas recreate memory at each point they were taken. */
+static int delta_write(vm_t *v, FILE *f, uint64_t *map) {
+	assert(v);
+	assert(f);
+	assert(map);
+	const uint64_t header[] = { DELTA_MAGIC, PAGE_SIZE, };
+	if (fwrite(header, 1, sizeof header, f) != sizeof header)
+		return -1;
+	for (uint64_t pg = 0; pg < v->msize / PAGE_SIZE; pg++) {
+		if (!map[pg / 64ull]) {
+			pg |= 63ull;
+			continue;
+		}
+		if (!page_get(map, pg))
+			continue;
+		const uint64_t addr = pg * PAGE_SIZE;
+		if (fwrite(&addr, 1, sizeof addr, f) != sizeof addr)
+			return -1;
+		if (fwrite(((uint8_t*)v->m) + addr, 1, PAGE_SIZE, f) != PAGE_SIZE)
+			return -1;
+	}
+	return 0;
+}
+
+/* Write the pages changed since the last snapshot to the next numbered file */
+static int snapshot(vm_t *v) {
+	assert(v);
+	if (!v->snapshot)
+		return -1;
+	char name[FILENAME_MAX];
+	if (snprintf(name, sizeof name, "%s.%03"PRIu64, v->snapshot, v->snapshots) >= (int)sizeof name)
+		return -1;
+	FILE *f = fopen(name, "wb");
+	if (!f)
+		return -1;
+	const int r = delta_write(v, f, v->dirty);
+	if (fclose(f) < 0 || r < 0)
+		return -1;
+	memset(v->dirty, 0, bitmap_size(v));
+	v->snapshots++;
+	return 0;
+}
+
+/* Memory access heatmap, enabled with '-M file[,period]'. Every 'period'th
+ * load, store or instruction fetch by the CPU is counted against the
+ * HEAT_LINE of RAM it falls in; counts in a dump are scaled back up by the
+ * period. Lines and pages, the sum of their lines, with no accesses are
+ * left out. The counters are only committed by the host as they are used.
+ * Each write to IO(1, 9) writes the accesses since the last one to
+ * 'file.NNN' and clears the counters, read IO(1, 9) for the number written,
+ * so a guest can take periodic heatmaps; the rest go to 'file' at exit. */
+static uint64_t heat_size(vm_t *v) { assert(v); return (v->msize / HEAT_LINE) * 3ull * sizeof (uint64_t); }
+
+static int heat_init(vm_t *v, const char *file, uint64_t period) {
+	assert(v);
+	assert(file);
+	heat_t *h = &v->heat;
+	if (h->count || !period || !(h->count = ram_alloc(heat_size(v), 0)))
+		return -1;
+	h->file = file;
+	h->period = period;
+	h->countdown = period;
+	v->profile = 1;
+	return 0;
+}
+
+static inline void heat_count(vm_t *v, uint64_t addr, int rwx) {
+	assert(v);
+	heat_t *h = &v->heat;
+	if (!h->count || --h->countdown)
+		return;
+	h->countdown = h->period;
+	if (within(addr, MEMORY_START, MEMORY_END(v)))
+		h->count[(((addr - MEMORY_START) / HEAT_LINE) * 3ull) + rwx]++;
+}
+
+static int heat_write(vm_t *v, const char *name) {
+	assert(v);
+	assert(name);
+	heat_t *h = &v->heat;
+	if (!h->count)
+		return -1;
+	FILE *f = fopen(name, "wb");
+	if (!f)
+		return -1;
+	int r = fprintf(f, "kind,address,reads,writes,fetches\n");
+	const uint64_t lines = PAGE_SIZE / HEAT_LINE;
+	for (uint64_t pg = 0; r >= 0 && pg < v->msize / PAGE_SIZE; pg++) {
+		const uint64_t *c = &h->count[pg * lines * 3ull];
+		uint64_t sum[3] = { 0, };
+		for (uint64_t i = 0; i < lines * 3ull; i++)
+			sum[i % 3] += c[i];
+		if (!(sum[0] | sum[1] | sum[2]))
+			continue;
+		const uint64_t addr = MEMORY_START + (pg * PAGE_SIZE);
+		r = fprintf(f, "page,%"PRIx64",%"PRIu64",%"PRIu64",%"PRIu64"\n", addr, sum[0] * h->period, sum[1] * h->period, sum[2] * h->period);
+		for (uint64_t i = 0; r >= 0 && i < lines; i++, c += 3) {
+			if (!(c[0] | c[1] | c[2]))
+				continue;
+			r = fprintf(f, "line,%"PRIx64",%"PRIu64",%"PRIu64",%"PRIu64"\n", addr + (i * HEAT_LINE),
+				c[0] * h->period, c[1] * h->period, c[2] * h->period);
+		}
+	}
+	if (fclose(f) < 0 || r < 0)
+		return -1;
+	return 0;
+}
+
+static int heat_snapshot(vm_t *v) {
+	assert(v);
+	heat_t *h = &v->heat;
+	if (!h->count)
+		return -1;
+	char name[FILENAME_MAX];
+	if (snprintf(name, sizeof name, "%s.%03"PRIu64, h->file, h->dumps) >= (int)sizeof name)
+		return -1;
+	if (heat_write(v, name) < 0)
+		return -1;
+	memset(h->count, 0, heat_size(v));
+	h->dumps++;
+	return 0;
+}
+
+/* Guest RAM is held little endian, so on a little endian host a range of
+ * physical memory can be used in place. */
+static uint8_t *phy_ptr(vm_t *v, uint64_t addr, uint64_t len) {
+	assert(v);
+	if (!within(addr, MEMORY_START, MEMORY_END(v)) || len > (MEMORY_END(v) - addr))
+		return NULL;
+	return ((uint8_t*)v->m) + (addr - MEMORY_START);
+}
+
+/* Host file system passthrough, I/O page 6. The guest places requests in a
+ * ring of descriptors of HD_WORDS words in RAM, given by IO(6, 1) and the
+ * number of entries by IO(6, 2), then writes its producer count to IO(6, 4).
+ * Each request from the consumer count, IO(6, 3), up to that is performed
+ * straight away with data moved directly to and from guest RAM, the result
+ * written back into the descriptor, and IRQ_HOSTFS raised when done. Paths
+ * are given by the buffer and length of a descriptor. A descriptor or buffer
+ * outside of RAM sets the error bit in IO(6, 0), bit 1, and stops the ring
+ * until it is cleared by writing that bit. With host I/O threads on requests
+ * complete later, in order, and the ring may not be moved while any are
+ * outstanding; doing so is an error, as is a producer count that moves
+ * backwards or more than the number of entries ahead of the consumer. */
+static int64_t hostfs_request(vm_t *v, uint64_t *d) {
+	assert(v);
+	assert(d);
+	hostfs_t *h = &v->hostfs;
+	const uint64_t handle = d[HD_HANDLE], len = d[HD_LEN];
+	const int fd = handle < HOSTFS_FILES ? h->fd[handle] - 1 : -1;
+	uint8_t *buf = phy_ptr(v, d[HD_BUF], len);
+	if (!buf && len)
+		return -EFAULT;
+	char path[HOSTFS_PATH] = { 0, };
+	switch (d[HD_OP]) {
+	case FS_NOP: return 0;
+	case FS_OPEN:
+	case FS_REMOVE:
+		if (len >= sizeof path)
+			return -ENAMETOOLONG;
+		memcpy(path, buf, len);
+		return d[HD_OP] == FS_OPEN ? hostfs_open(h, path, d[HD_FLAGS]) : hostfs_remove(h, path);
+	}
+	if (fd < 0)
+		return -EBADF;
+	switch (d[HD_OP]) {
+	case FS_CLOSE: return hostfs_close(h, fd, handle);
+	case FS_READ:
+		return len ? hostfs_io(fd, buf, len, d[HD_OFFSET], 0) : 0;
+	case FS_WRITE: return len ? hostfs_io(fd, buf, len, d[HD_OFFSET], 1) : 0;
+	case FS_SIZE:  return hostfs_size(fd);
+	}
+	return -ENOSYS;
+}
+
+static uint64_t *hostfs_descriptor(vm_t *v, uint64_t n, uint64_t *addr) {
+	assert(v);
+	assert(addr);
+	hostfs_t *h = &v->hostfs;
+	if (!h->entries)
+		return NULL;
+	*addr = h->ring + ((n % h->entries) * HD_WORDS * sizeof (uint64_t));
+	return !(*addr & 7ull) ? (uint64_t*)phy_ptr(v, *addr, HD_WORDS * sizeof (uint64_t)) : NULL;
+}
+
+static void hostfs_complete(vm_t *v, uint64_t addr) {
+	assert(v);
+	uint64_t *d = (uint64_t*)phy_ptr(v, addr, HD_WORDS * sizeof (uint64_t));
+	assert(d);
+	uint8_t *buf = d[HD_OP] == FS_READ && (int64_t)d[HD_RESULT] > 0 ? phy_ptr(v, d[HD_BUF], d[HD_RESULT]) : NULL;
+	if (buf) {
+		journal_data(v, buf, d[HD_RESULT]);
+		dirty_mark(v, d[HD_BUF], d[HD_RESULT]);
+	}
+	dirty_mark(v, addr, HD_WORDS * sizeof (uint64_t));
+	v->effects++;
+	v->hostfs.head++;
+}
+
+static void hostfs_issue(vm_t *v) {
+	assert(v);
+	hostfs_t *h = &v->hostfs;
+	if (!h->dir || h->error)
+		return;
+	const uint64_t head = h->head;
+	for (; h->issued != h->tail; h->issued++) {
+		uint64_t addr = 0, *d = hostfs_descriptor(v, h->issued, &addr);
+		if (!d) {
+			h->error = 1;
+			break;
+		}
+		if (v->io.on) {
+			if (io_request(v, addr) < 0)
+				break; /* re-issued as requests complete */
+			continue;
+		}
+		d[HD_RESULT] = journal(v, J_HOSTFS, replaying(v) ? 0 : (uint64_t)hostfs_request(v, d));
+		hostfs_complete(v, addr);
+	}
+	if (h->head != head)
+		irq_raise(v, IRQ_HOSTFS);
+}
+
+static void hostfs_doorbell(vm_t *v, uint64_t tail) {
+	assert(v);
+	hostfs_t *h = &v->hostfs;
+	if (tail - h->head > h->entries || tail < h->issued) {
+		h->error = 1;
+		return;
+	}
+	h->tail = tail;
+	hostfs_issue(v);
+}
+
+static void hostfs_ring(vm_t *v, uint64_t ring, uint64_t entries) {
+	assert(v);
+	hostfs_t *h = &v->hostfs;
+	if (io_wanted(v)) {
+		h->error = 1;
+		return;
+	}
+	h->ring = ring;
+	h->entries = entries;
+	h->head = h->tail = h->issued = 0;
+}
+
+#ifdef USE_THREADS
+static void *console_thread(void *arg) {
+	vm_t *v = arg;
+	io_t *io = &v->io;
+	int pending = EOF, eof = 0;
+	for (;;) {
+		const int stop = __atomic_load_n(&io->stop, __ATOMIC_ACQUIRE);
+		uint64_t ch = 0;
+		int out = 0;
+		for (; queue_pop(&io->tx, &ch) == 0; out = 1)
+			(void)putchar((int)ch);
+		if (out) {
+			(void)fflush(stdout);
+			io_wake(io->space[1]);
+		}
+		if (stop)
+			return NULL;
+		if (pending != EOF && queue_push(&io->rx, (uint64_t)pending) >= 0) {
+			pending = EOF;
+			io_wake(io->ready[1]);
+		}
+		struct pollfd pfd[] = {
+			{ .fd = io->wake_console[0], .events = POLLIN, },
+			{ .fd = io->terminal && pending == EOF && !eof ? TERMINAL_FD : -1, .events = POLLIN, },
+		};
+		if (poll(pfd, NELEMS(pfd), pending == EOF ? IO_WAIT_MS : 1) <= 0)
+			continue;
+		if (pfd[0].revents)
+			io_drain(io->wake_console[0]);
+		if (pfd[1].revents)
+			eof = (pending = getch(&v->console.terminal)) == EOF;
+	}
+}
+
+static void *hostfs_thread(void *arg) {
+	vm_t *v = arg;
+	io_t *io = &v->io;
+	for (;;) {
+		const int stop = __atomic_load_n(&io->stop, __ATOMIC_ACQUIRE);
+		uint64_t addr = 0;
+		while (queue_pop(&io->requests, &addr) == 0) {
+			uint64_t *d = (uint64_t*)phy_ptr(v, addr, HD_WORDS * sizeof (uint64_t));
+			d[HD_RESULT] = hostfs_request(v, d);
+			const int r = queue_push(&io->completions, addr);
+			assert(r >= 0); /* outstanding requests are limited to QUEUE_SIZE */
+			(void)r;
+			io_wake(io->ready[1]);
+		}
+		if (stop)
+			return NULL;
+		struct pollfd pfd = { .fd = io->wake_hostfs[0], .events = POLLIN, };
+		if (poll(&pfd, 1, IO_WAIT_MS) > 0)
+			io_drain(io->wake_hostfs[0]);
+	}
+}
+
+static void io_poll(vm_t *v) {
+	assert(v);
+	const uint64_t head = v->hostfs.head;
+	uint64_t addr = 0;
+	while (queue_pop(&v->io.completions, &addr) == 0)
+		hostfs_complete(v, addr);
+	if (v->hostfs.head != head) {
+		irq_raise(v, IRQ_HOSTFS);
+		hostfs_issue(v);
+	}
+}
+
+static void io_stop(vm_t *v) {
+	assert(v);
+	io_t *io = &v->io;
+	if (!io->on)
+		return;
+	__atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+	io_wake(io->wake_console[1]);
+	io_wake(io->wake_hostfs[1]);
+	(void)pthread_join(io->console, NULL);
+	(void)pthread_join(io->hostfs, NULL);
+	int *pipes[] = { io->wake_console, io->wake_hostfs, io->ready, io->space, };
+	for (size_t i = 0; i < NELEMS(pipes); i++) {
+		(void)close(pipes[i][0]);
+		(void)close(pipes[i][1]);
+	}
+	io->on = io->terminal = 0;
+}
+
+static int io_start(vm_t *v) {
+	assert(v);
+	io_t *io = &v->io;
+	int *pipes[] = { io->wake_console, io->wake_hostfs, io->ready, io->space, };
+	size_t i = 0;
+	for (; i < NELEMS(pipes); i++) {
+		if (pipe(pipes[i]) < 0)
+			goto fail;
+		(void)fcntl(pipes[i][0], F_SETFL, O_NONBLOCK);
+		(void)fcntl(pipes[i][1], F_SETFL, O_NONBLOCK);
+	}
+	io->stop = 0;
+	io->terminal = !v->console.getch && !v->console.putch;
+	if (pthread_create(&io->console, NULL, console_thread, v))
+		goto fail;
+	if (pthread_create(&io->hostfs, NULL, hostfs_thread, v)) {
+		__atomic_store_n(&io->stop, 1, __ATOMIC_RELEASE);
+		io_wake(io->wake_console[1]);
+		(void)pthread_join(io->console, NULL);
+		goto fail;
+	}
+	io->on = 1;
+	return 0;
+fail:
+	while (i--) {
+		(void)close(pipes[i][0]);
+		(void)close(pipes[i][1]);
+	}
+	return -1;
+}
+#else
+static void io_poll(vm_t *v) { assert(v); }
+static void io_stop(vm_t *v) { assert(v); }
+static int io_start(vm_t *v) { assert(v); return -1; }
+#endif
+
+/* Shared memory channel, I/O page 7. The object is mapped at SHM_START for
+ * IO(7, 0) bytes. Aligned word accesses to it are single atomic operations,
+ * loads acquire and stores release, so lock free single producer single
+ * consumer queues can be built between the guest and host processes. A
+ * write to IO(7, 1) notifies the host, counted in IO(7, 1); notifications
+ * from the host add to IO(7, 2) and raise IRQ_SHM. */
+#ifdef __GNUC__
+static inline uint64_t shm_load(uint8_t *p) { return __atomic_load_n((uint64_t*)p, __ATOMIC_ACQUIRE); }
+static inline void shm_store(uint8_t *p, uint64_t val) { __atomic_store_n((uint64_t*)p, val, __ATOMIC_RELEASE); }
+#else
+static inline uint64_t shm_load(uint8_t *p) { return *(volatile uint64_t*)p; }
+static inline void shm_store(uint8_t *p, uint64_t val) { *(volatile uint64_t*)p = val; }
+#endif
+
+/* Devices provided by an embedding host, 'addr' is the word within I/O
+ * space, non zero is returned if the access faults or nothing is there */
+static int mmio_access(vm_t *v, uint64_t addr, uint64_t *val, int rwx) {
+	assert(v);
+	assert(val);
+	const uint64_t page = addr / (PAGE_SIZE / sizeof (uint64_t)), offset = addr % (PAGE_SIZE / sizeof (uint64_t));
+	for (size_t i = 0; i < NELEMS(v->mmio); i++) {
+		mmio_t *d = &v->mmio[i];
+		if (d->page != page || !(d->read || d->write))
+			continue;
+		const int r = rwx == WRITE ? (d->write ? d->write(d->param, offset, *val) : -1) : (d->read ? d->read(d->param, offset, val) : -1);
+		if (r == VM_STOPPED)
+			v->stop = 1;
+		return r < 0;
+	}
+	return 1;
+}
+
+/* Physical memory and device accesses, without trapping, for either core */
+static int bus_load(vm_t *v, uint64_t addr, uint64_t *val) {
+	assert(v);
+	assert(val);
+	*val = 0;
+	if (addr & 7ull)
+		return -1;
+
+	if (within(addr, MEMORY_START, MEMORY_END(v))) {
+		addr -= MEMORY_START;
+		addr /= sizeof (uint64_t);
+		*val = v->m[addr];
+		return 0;
+	}
+
+	if (within(addr, SHM_START, SHM_START + v->shm.size)) {
+		v->effects++; /* another process may change it, so a loop polling it is not idle */
+		*val = shm_load(v->shm.base + (addr - SHM_START));
+		return 0;
+	}
+
+	if (within(addr, IO_START, IO_END)) {
+		addr -= IO_START;
+		addr /= sizeof (uint64_t);
+		switch (addr) {
+		/* PAGE 0 = Info */
+		case IO(0, 0): *val = 1; /* version */ return 0;
+		case IO(0, 1): *val = sizeof (uint64_t); return 0;
+		case IO(0, 2): *val = NELEMS(v->tlb_va); return 0;
+		case IO(0, 3): *val = PAGE_SIZE; return 0;
+		case IO(0, 4): *val = TRAPS; return 0;
+		case IO(0, 6): *val = v->msize; return 0;
+		case IO(0, 5): *val = 0xF | (v->hostfs.dir ? 0x10 : 0) | (v->shm.size ? 0x20 : 0); return 0; /* available I/O:  UART + DISK + interrupt controller + hypercalls + host file system + shared memory */
+		/* PAGE 1 = Basic system registers */
+		case IO(1, 0): *val = v->halt; return 0;
+		case IO(1, 1): *val = v->tron; return 0;
+		case IO(1, 2): *val = v->tick; v->loop.tick = 1; return 0;
+		case IO(1, 3): *val = v->timer; return 0;
+		case IO(1, 4): *val = v->rtc_control; return 0;
+		case IO(1, 5): *val = v->rtc_s; return 0;
+		case IO(1, 6): *val = v->rtc_frac_s; return 0;
+		case IO(1, 7): *val = v->hypercall; return 0;
+		case IO(1, 8): *val = v->snapshots; return 0;
+		case IO(1, 9): *val = v->heat.dumps; return 0;
+		/* PAGE 2 = UART */
+		case IO(2, 0): /* bit 3 = RX queue not empty, bit 5 = TX queue not empty */
+			*val = 0x4 | (v->uart_ready << 3);
+			v->loop.uart |= uart_wanted(v); /* input will change it */
+			return 0;
+		case IO(2, 1): *val = v->uart_rx; return 0;
+		case IO(2, 2): *val = v->uart_tx; return 0;
+		/* PAGE 3 = Disk Control */
+		case IO(3, 0): *val = v->dstat; return 0;
+		case IO(3, 1): 
+			v->effects++;
+			bit_clr(&v->dstat, 0); /* never busy */
+			bit_clr(&v->dstat, 1); /* do operation always reads 0 */
+			*val = v->dstat & 0x1Full;
+			return 0;
 		/* PAGE 4 = Disk Buffer */
+		/* PAGE 5 = Interrupt Controller */
+		case IO(5, 0): *val = v->irq_pending; return 0;
+		case IO(5, 1): *val = v->irq_enable; return 0;
+		case IO(5, 2): *val = v->irq_threshold; return 0;
+		case IO(5, 3): v->effects++; *val = irq_claim(v); return 0;
+		/* PAGE 6 = Host file system */
+		case IO(6, 0): *val = (v->hostfs.dir ? 1 : 0) | (v->hostfs.error << 1); return 0;
+		case IO(6, 1): *val = v->hostfs.ring; return 0;
+		case IO(6, 2): *val = v->hostfs.entries; return 0;
+		case IO(6, 3): *val = v->hostfs.head; return 0;
+		case IO(6, 4): *val = v->hostfs.tail; return 0;
+		/* PAGE 7 = Shared memory channel */
+		case IO(7, 0): *val = v->shm.size; return 0;
+		case IO(7, 1): *val = v->shm.kicks; return 0;
+		case IO(7, 2): *val = v->shm.notifies; return 0;
+		}
+
+		if (within(addr, IO(5, 8), IO(5, 8) + IRQS)) {
+			*val = v->irq_priority[addr - IO(5, 8)];
+			return 0;
 		}
 
 		if (within(addr, IO(4, 0), IO(4, 0) + (sizeof (v->dbuf)/sizeof (uint64_t)))) {
 			*val = v->dbuf[addr - IO(4, 0)];
 			return 0;
 		}
+
+		if (mmio_access(v, addr, val, READ) == 0)
+			return 0;
 	}
 
-	return trap(v, T_ADDR, v->pc);
+	return -1;
+}
+
+static int load_phy(vm_t *v, uint64_t addr, uint64_t *val) {
+	if (bus_load(v, addr, val) < 0)
+		return trap(v, addr & 7ull ? T_ALIGN : T_ADDR, v->pc);
+	return 0;
 }
 
-static int store_phy(vm_t *v, uint64_t addr, uint64_t val) {
+static int bus_store(vm_t *v, uint64_t addr, uint64_t val) {
 	assert(v);
+	v->effects++;
 	if (addr & 7ull)
-		return trap(v, T_ALIGN, v->pc);
+		return -1;
 
-	if (within(addr, MEMORY_START, MEMORY_END)) {
+	if (within(addr, MEMORY_START, MEMORY_END(v))) {
+		dirty_mark(v, addr, sizeof val);
 		addr -= MEMORY_START;
 		addr /= sizeof (uint64_t);
 		v->m[addr] = val;
 		return 0;
 	}
 
+	if (within(addr, SHM_START, SHM_START + v->shm.size)) {
+		shm_store(v->shm.base + (addr - SHM_START), val);
+		return 0;
+	}
+
 	if (within(addr, IO_START, IO_END)) {
 		addr -= IO_START;
 		addr /= sizeof (uint64_t);
@@ -379,24 +1859,37 @@ static int store_phy(vm_t *v, uint64_t addr, uint64_t val) {
 		/* PAGE 0 = Info */
 		/* PAGE 1 = Basic system registers */
 		case IO(1, 0): v->halt = val; return 0;
-		case IO(1, 1): v->tron = val; return 0;
+		case IO(1, 1): v->retrace = bit_get(v->tron ^ val, 0); v->tron = val; return 0;
 		case IO(1, 2): v->tick = val; return 0;
-		case IO(1, 3): v->timer = val; return 0;
+		case IO(1, 3): v->timer = val; v->rv.mip &= ~(1ull << RV_MTI); /* also acknowledges the RISC-V timer */ return 0;
 		case IO(1, 4): if (val & 1) {
-				v->rtc_s = time(NULL);
+				v->rtc_s = journal(v, J_RTC, replaying(v) ? 0 : (uint64_t)time(NULL));
 				v->rtc_frac_s = 0;
 			       }; return 0;
 		case IO(1, 5): v->rtc_s = val; return 0;
 		case IO(1, 6): v->rtc_frac_s = val; return 0;
+		case IO(1, 7): v->hypercall = val & 1ull; return 0;
+		case IO(1, 8): (void)snapshot(v); return 0;
+		case IO(1, 9): (void)heat_snapshot(v); return 0;
 		/* PAGE 2 = UART */
 		case IO(2, 0):
-			if (val & 1ull)
-				v->uart_rx = wrap_getch();
+			if (val & 1ull) {
+				if (v->uart_ready) {
+					v->uart_rx = v->uart_buf;
+					v->uart_ready = 0;
+				} else {
+					v->uart_rx = uart_getch(v);
+					if ((int)v->uart_rx == EOF && !(val & 2ull)) { /* an empty poll changes nothing */
+						v->effects--;
+						v->loop.uart = 1;
+					}
+				}
+			}
 			if (val & 2ull)
-				v->uart_tx = wrap_putch(v->uart_tx);
+				v->uart_tx = console_putch(v, (int)v->uart_tx);
 			return 0;
 		case IO(2, 1): v->uart_rx = val; return 0;
-		case IO(2, 2): v->uart_rx = val; return 0;
+		case IO(2, 2): v->uart_tx = val; return 0;
 		/* PAGE 3 = Disk Control */
 		case IO(3, 0): 
 			BUILD_BUG_ON((sizeof(v->disk) % sizeof(v->dbuf) != 0));
@@ -404,7 +1897,7 @@ static int store_phy(vm_t *v, uint64_t addr, uint64_t val) {
 			if (v->dstat & 0x10ull)
 				return 0;
        			if (bit_get(val, 1)) {
-				if ((v->dp / sizeof (uint64_t)) > (sizeof (v->disk) / sizeof(v->dbuf))) {
+				if (v->dp > (sizeof (v->disk) - sizeof (v->dbuf)) || (v->dp & 7ull)) {
 					v->dstat |= 0x10ull;
 					return 0;
 				}
@@ -415,27 +1908,84 @@ static int store_phy(vm_t *v, uint64_t addr, uint64_t val) {
 				} else {
 					memcpy(&v->dbuf[0], &v->disk[v->dp / sizeof (uint64_t)], sizeof v->dbuf);
 				}
+				irq_raise(v, IRQ_DISK);
 			}
 			return 0;
 		case IO(3, 1): v->dp = val; return 0;
 		/* PAGE 4 = Disk Buffer */
+		/* PAGE 5 = Interrupt Controller */
+		case IO(5, 1): v->irq_enable = val; return 0;
+		case IO(5, 2): v->irq_threshold = val; return 0;
+		case IO(5, 3): if (val < IRQS) bit_clr(&v->irq_service, val); return 0;
+		/* PAGE 6 = Host file system */
+		case IO(6, 0): if (val & 2ull) v->hostfs.error = 0; return 0;
+		case IO(6, 1): hostfs_ring(v, val, v->hostfs.entries); return 0;
+		case IO(6, 2): hostfs_ring(v, v->hostfs.ring, val); return 0;
+		case IO(6, 4): hostfs_doorbell(v, val); return 0;
+		/* PAGE 7 = Shared memory channel */
+		case IO(7, 1): v->shm.kicks++; (void)shm_kick(&v->shm); return 0;
+		case IO(7, 2): v->shm.notifies = val; return 0;
+		}
+
+		if (within(addr, IO(5, 8), IO(5, 8) + IRQS)) {
+			v->irq_priority[addr - IO(5, 8)] = val;
+			return 0;
 		}
 
 		if (within(addr, IO(4, 0), IO(4, 0) + (sizeof (v->dbuf)/sizeof (uint64_t)))) {
 			v->dbuf[addr - IO(4, 0)] = val;
 			return 0;
 		}
+
+		if (mmio_access(v, addr, &val, WRITE) == 0)
+			return 0;
 	}
-	return trap(v, T_ADDR, v->pc);
+	return -1;
 }
 
-static int loadw(vm_t *v, uint64_t addr, uint64_t *val, int rwx) {
-	assert(v);
-	assert(val);
-	if (bit_get(v->flags, VIRT))
-		if (tlb_lookup(v, addr, &addr, rwx))
-			return 1;
-	return load_phy(v, addr, val);
+static int store_phy(vm_t *v, uint64_t addr, uint64_t val) {
+	if (bus_store(v, addr, val) < 0)
+		return trap(v, addr & 7ull ? T_ALIGN : T_ADDR, v->pc);
+	return 0;
+}
+
+/* With virtual memory on, the top of the address space from KSEG_START is a
+ * direct window onto physical memory, usable only in privileged mode. It
+ * bypasses the TLB entirely so the kernel needs no entries for itself. */
+static int translate(vm_t *v, uint64_t vaddr, uint64_t *paddr, int rwx) {
+	assert(v);
+	assert(paddr);
+	*paddr = vaddr;
+	if (bit_get(v->flags, VIRT) == 0)
+		return 0;
+	if (vaddr >= KSEG_START) {
+		if (bit_get(v->flags, PRIV) == 0)
+			return trap(v, T_PROTECT, vaddr);
+		*paddr = vaddr - KSEG_START;
+		return 0;
+	}
+	return tlb_lookup(v, vaddr, paddr, rwx);
+}
+
+/* Feed a CPU fetch, load or store to the heatmap, cache simulator and access
+ * trace, whichever are on; 'virtual' if the address went through a TLB.
+ * Only RAM is cached. */
+static void profile(vm_t *v, uint64_t vaddr, uint64_t paddr, int rwx, int virtual) {
+	assert(v);
+	heat_count(v, paddr, rwx);
+	const unsigned kind = rwx | (virtual ? CACHE_VIRTUAL : 0) | (within(paddr, MEMORY_START, MEMORY_END(v)) ? 0 : CACHE_UNCACHED);
+	profile_record(v, kind, vaddr, paddr);
+}
+
+static int loadw(vm_t *v, uint64_t addr, uint64_t *val, int rwx) {
+	assert(v);
+	assert(val);
+	uint64_t pa = 0;
+	if (translate(v, addr, &pa, rwx & 3))
+		return 1;
+	if (v->profile && !(rwx & UNPROFILED))
+		profile(v, addr, pa, rwx, bit_get(v->flags, VIRT) && addr < KSEG_START);
+	return load_phy(v, pa, val);
 }
 
 static int loadb(vm_t *v, uint64_t addr, uint8_t *val) {
@@ -450,17 +2000,18 @@ static int loadb(vm_t *v, uint64_t addr, uint8_t *val) {
 
 static int storew(vm_t *v, uint64_t addr, uint64_t val) {
 	assert(v);
-	if (bit_get(v->flags, VIRT))
-		if (tlb_lookup(v, addr, &addr, WRITE))
-			return 1;
-	return store_phy(v, addr, val);
+	uint64_t pa = 0;
+	if (translate(v, addr, &pa, WRITE))
+		return 1;
+	if (v->profile)
+		profile(v, addr, pa, WRITE, bit_get(v->flags, VIRT) && addr < KSEG_START);
+	return store_phy(v, pa, val);
 }
 
 static int storeb(vm_t *v, uint64_t addr, uint8_t val) {
 	assert(v);
-	assert(val);
 	uint64_t orig = 0;
-	if (loadw(v, addr & (~7ull), &orig, READ))
+	if (loadw(v, addr & (~7ull), &orig, READ | UNPROFILED))
 		return 1;
 	const unsigned shift = (addr & 7ull) * CHAR_BIT;
 	orig &= ~(0xFFull << shift);
@@ -468,16 +2019,192 @@ static int storeb(vm_t *v, uint64_t addr, uint8_t val) {
 	return storew(v, addr & ~7ull, orig);
 }
 
-static int cpu(vm_t *v) {
+/* Copy between the host and a guest virtual buffer, page by page */
+static int guest_copy(vm_t *v, uint64_t addr, uint8_t *buf, uint64_t len, int rwx) {
+	assert(v);
+	assert(buf);
+	while (len) {
+		uint64_t pa = 0, n = PAGE_SIZE - (addr & PAGE_MASK);
+		n = n < len ? n : len;
+		if (translate(v, addr, &pa, rwx))
+			return 1;
+		uint8_t *p = phy_ptr(v, pa, n);
+		if (!p)
+			return trap(v, T_ADDR, addr);
+		if (rwx == WRITE) {
+			memcpy(p, buf, n);
+			dirty_mark(v, pa, n);
+		} else {
+			memcpy(buf, p, n);
+		}
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Paravirtual services, for guests that have enabled them through IO(1, 7),
+ * are requested with a T_HYPERCALL trap instruction. The trap value selects
+ * the service, r1 holds a buffer address (or argument) and r2 its length,
+ * the result is returned in r1. Unmodified guests, and user mode, see an
+ * ordinary trap. HC_RANDOM returns -1 if the host has no entropy to give. */
+static int hypercall(vm_t *v, uint64_t service) {
+	assert(v);
+	uint8_t buf[4096];
+	uint64_t addr = v->r[1], len = v->r[2], done = 0;
+	v->effects++;
+	switch (service) {
+	case HC_WRITE:
+		for (uint64_t n = 0; done < len; done += n) {
+			n = len - done < sizeof buf ? len - done : sizeof buf;
+			if (guest_copy(v, addr + done, buf, n, READ))
+				return 1;
+			if (v->io.terminal || v->console.putch) {
+				for (uint64_t i = 0; i < n; i++)
+					(void)console_putch(v, buf[i]);
+				continue;
+			}
+			if (fwrite(buf, 1, n, stdout) != n)
+				break;
+		}
+		(void)fflush(stdout);
+		v->r[1] = done;
+		return 0;
+	case HC_CLOCK:
+		v->r[1] = journal(v, J_CLOCK, replaying(v) ? 0 : now_ns());
+		return 0;
+	case HC_RANDOM:
+		for (uint64_t n = 0; done < len; done += n) {
+			n = len - done < sizeof buf ? len - done : sizeof buf;
+			if (!journal(v, J_RANDOM, replaying(v) || host_random(&v->random, buf, n) == 0)) {
+				v->r[1] = -1; /* never hand out predictable bytes */
+				return 0;
+			}
+			journal_data(v, buf, n);
+			if (guest_copy(v, addr + done, buf, n, WRITE))
+				return 1;
+		}
+		v->r[1] = done;
+		return 0;
+	case HC_EXIT:
+		v->status = addr;
+		v->halt = 1;
+		return 0;
+	}
+	v->r[1] = -1;
+	return 0;
+}
+
+/* The stack grows downwards and the stack pointer points at the last item
+ * pushed. If either guard register is non-zero the stack pointer must stay
+ * within [SR_STACK_LO, SR_STACK_HI] or the operation traps to T_STACK. */
+static int stack_guard(vm_t *v, uint64_t sp) {
+	assert(v);
+	const uint64_t lo = v->sreg[SR_STACK_LO], hi = v->sreg[SR_STACK_HI];
+	if ((lo || hi) && (sp < lo || sp > hi))
+		return trap(v, T_STACK, sp);
+	return 0;
+}
+
+static int push(vm_t *v, uint64_t val) {
+	assert(v);
+	const uint64_t sp = v->r[SP] - sizeof (uint64_t);
+	if (stack_guard(v, sp) || storew(v, sp, val))
+		return 1;
+	v->r[SP] = sp;
+	return 0;
+}
+
+static int pop(vm_t *v, uint64_t *val) {
+	assert(v);
+	assert(val);
+	const uint64_t sp = v->r[SP];
+	if (stack_guard(v, sp + sizeof (uint64_t)) || loadw(v, sp, val, READ))
+		return 1;
+	v->r[SP] = sp + sizeof (uint64_t);
+	return 0;
+}
+
+/* Registers in 'mask' are stored lowest register at lowest address, the
+ * stack pointer itself is never saved or restored. */
+static int push_multiple(vm_t *v, uint64_t mask) {
+	assert(v);
+	mask &= ~(1ull << SP) & ((1ull << REGS) - 1ull);
+	const uint64_t sp = v->r[SP] - (popcnt(mask) * sizeof (uint64_t));
+	if (stack_guard(v, sp))
+		return 1;
+	for (uint64_t i = 0, p = sp; i < REGS; i++)
+		if (bit_get(mask, i)) {
+			if (storew(v, p, v->r[i]))
+				return 1;
+			p += sizeof (uint64_t);
+		}
+	v->r[SP] = sp;
+	return 0;
+}
+
+static int pop_multiple(vm_t *v, uint64_t mask) {
+	assert(v);
+	mask &= ~(1ull << SP) & ((1ull << REGS) - 1ull);
+	uint64_t r[REGS] = { 0, };
+	const uint64_t sp = v->r[SP] + (popcnt(mask) * sizeof (uint64_t));
+	if (stack_guard(v, sp))
+		return 1;
+	for (uint64_t i = 0, p = v->r[SP]; i < REGS; i++)
+		if (bit_get(mask, i)) {
+			if (loadw(v, p, &r[i], READ))
+				return 1;
+			p += sizeof (uint64_t);
+		}
+	for (uint64_t i = 0; i < REGS; i++)
+		if (bit_get(mask, i))
+			v->r[i] = r[i];
+	v->r[SP] = sp;
+	return 0;
+}
+
+/* Instructions are normally 64-bit; an operation word in the upper half and
+ * a 32-bit immediate in the lower half. If bit 27 of the operation word is
+ * set the 64-bit word instead holds a pair of compact 32-bit instructions,
+ * the lower half executed first, each laid out as:
+ *
+ *	31-28 condition, 27 always set, 26-20 ALU operation, 19-16 register A,
+ *	15-14 mode, 13-0 register B (bits 3-0) or signed immediate.
+ *
+ * Mode 0 uses register B, mode 1 replaces B with the immediate, mode 2
+ * replaces A with the immediate and mode 3 with the immediate plus the PC. */
+#define COMPACT (0x08000000ul)
+
+/* Expanded twice, by RUN, with 'traced' constant so the untraced copy has
+ * no trace checks at all */
+static ALWAYS_INLINE int cpu(vm_t *v, const int traced) {
 	assert(v);
 	uint64_t instr = 0, npc = v->pc + sizeof(uint64_t);
-	if (loadw(v, v->pc, &instr, EXECUTE))
+	if (loadw(v, v->pc & ~7ull, &instr, EXECUTE))
 		goto trapped;
-	const uint32_t op = instr >> 32;
-	const uint32_t op1 = instr & 0xFFFFFFFFul;
-	const uint8_t ras = op;
-	const uint8_t rbs = op >> 8;
-	const uint8_t alu = op >> 16;
+	uint32_t op = instr >> 32;
+	uint32_t op1 = instr & 0xFFFFFFFFul;
+	uint8_t ras = op;
+	uint8_t rbs = op >> 8;
+	uint8_t alu = op >> 16;
+	if (op & COMPACT) {
+		const uint32_t c = v->pc & 4ull ? op : op1;
+		const uint32_t mode = (c >> 14) & 3ul;
+		npc = v->pc + sizeof(uint32_t);
+		op = c & 0xF0000000ul;
+		op1 = c & 0x2000ul ? c | 0xFFFFC000ul : c & 0x3FFFul;
+		alu = (c >> 20) & 0x7Ful;
+		ras = ((c >> 16) & 15ul) | (mode & 2ul ? 0x30 : 0) | (mode == 3 ? 0x40 : 0);
+		rbs = (c & 15ul) | (mode == 1 ? 0x30 : 0);
+		if (!(c & COMPACT)) { /* both halves of a pair must be compact */
+			alu = 0xFF;
+			ras = rbs = 0;
+		}
+	} else if (v->pc & 4ull) {
+		alu = 0xFF; /* 64-bit instructions must be aligned */
+		ras = rbs = 0;
+	}
 	const uint8_t b = rbs & 15;
 	const uint8_t a = ras & 15;
 	uint64_t rb = v->r[b];
@@ -485,7 +2212,7 @@ static int cpu(vm_t *v) {
 	uint64_t trap_addr = 0;
 	uint64_t trap_val = v->pc;
 
-	if (trace(v, "+pc,%"PRIx64",%"PRIx64",%"PRIx64",", v->pc, instr, op1) < 0)
+	if (traced && trace(v, "+pc,%"PRIx64",%"PRIx64",%"PRIx64",", v->pc, instr, op1) < 0)
 		return -1;
 	if ((op & 0x80000000ul) && !bit_get(v->flags, V))
 		goto next;
@@ -497,13 +2224,14 @@ static int cpu(vm_t *v) {
 		goto next;
 	uint64_t nra = ra;
 
-	if (ras & 0x1) { ra = op1; }
-	if (ras & 0x2) { ra = ra & 0x0000000080000000ull ? ra | 0xFFFFFFFF00000000ull : ra; }
-	if (ras & 0x4) { ra += v->pc; }
-	if (rbs & 0x1) { rb = op1; }
-	if (rbs & 0x2) { rb = rb & 0x0000000080000000ull ? rb | 0xFFFFFFFF00000000ull : rb; }
-	if (rbs & 0x4) { rb += v->pc; }
-	if (ras & 0x8 || rbs & 0x8) { trap_addr = T_INST; goto on_trap; }
+	/* operand byte: low nibble is the register, high nibble the modifiers */
+	if (ras & 0x10) { ra = op1; }
+	if (ras & 0x20) { ra = ra & 0x0000000080000000ull ? ra | 0xFFFFFFFF00000000ull : ra; }
+	if (ras & 0x40) { ra += v->pc; }
+	if (rbs & 0x10) { rb = op1; }
+	if (rbs & 0x20) { rb = rb & 0x0000000080000000ull ? rb | 0xFFFFFFFF00000000ull : rb; }
+	if (rbs & 0x40) { rb += v->pc; }
+	if (ras & 0x80 || rbs & 0x80) { trap_addr = T_INST; goto on_trap; }
 
 	switch (alu) {
 	case  0: nra = ra; break;
@@ -520,10 +2248,38 @@ static int cpu(vm_t *v) {
 	case 11: nra = ra + rb; bit_cnd(&v->flags, C, nra < ra); bit_cnd(&v->flags, V, ((nra ^ ra) & (nra ^ rb)) >> 63); break;
 	case 12: ra -= bit_get(v->flags, C); /* fall-through */
 	case 13: nra = ra - rb; bit_cnd(&v->flags, C, nra > ra); bit_cnd(&v->flags, V, ((nra ^ ra) & (nra ^ rb)) >> 63); break;
+	case 14: /* signed divide, INT64_MIN / -1 overflows and sets V */
+		if (!rb) { trap_addr = T_DIV0; goto on_trap; }
+		if (ra == (1ull << 63) && rb == ~0ull) { nra = ra; bit_set(&v->flags, V); break; }
+		nra = (uint64_t)((int64_t)ra / (int64_t)rb);
+		break;
+	case 15: if (!rb) { trap_addr = T_DIV0; goto on_trap; } nra = ra % rb; break;
+	case 16: /* signed remainder, sign follows the dividend */
+		if (!rb) { trap_addr = T_DIV0; goto on_trap; }
+		nra = rb == ~0ull ? 0 : (uint64_t)((int64_t)ra % (int64_t)rb);
+		break;
+	case 17: nra = asr(ra, rb); break;
+	case 18: nra = rotl(ra, rb); break;
+	case 19: nra = rotr(ra, rb); break;
+	case 20: nra = clz(ra); break;
+	case 21: nra = ctz(ra); break;
+	case 22: nra = popcnt(ra); break;
+	case 23: nra = mulhu(ra, rb); break;
+	case 24: nra = mulhs(ra, rb); break;
 	/* NB. Need to add floating point instructions, which will also set arithmetic flags */
 
-	case 32: npc = ra; break; /* jump */
+	case 32: /* jump */
+		npc = ra;
+		if (v->fast && npc <= v->pc && (v->pc - npc) <= LOOP_MAX)
+			loop_check(v, npc);
+		break;
 	case 33: nra = npc; npc = ra; break; /* link */
+	case 34: if (push(v, npc)) goto trapped; npc = ra; nra = v->r[a]; break; /* call */
+	case 35: if (pop(v, &npc)) goto trapped; nra = v->r[a]; break; /* return */
+	case 36: if (push(v, ra)) goto trapped; nra = v->r[a]; break;
+	case 37: if (pop(v, &nra)) goto trapped; break;
+	case 38: if (push_multiple(v, ra)) goto trapped; nra = v->r[a]; break;
+	case 39: if (pop_multiple(v, ra)) goto trapped; nra = v->r[a]; break;
 
 	case 48: nra = v->flags; break;
 	case 49:
@@ -533,6 +2289,8 @@ static int cpu(vm_t *v) {
 			break;
 		}
 		v->flags = ra;
+		if (bank_select(v))
+			goto next; /* the write back would go to the new bank */
 		break;
 	case 50: nra = v->traps[ra % TRAPS]; break;
 	case 51:
@@ -542,13 +2300,47 @@ static int cpu(vm_t *v) {
 		}
 		v->traps[ra % TRAPS] = rb;
 		break;
+	case 52: nra = v->sreg[ra % SREGS]; break;
+	case 53:
+		if (bit_get(v->flags, PRIV) == 0) {
+			trap_addr = T_PRIV;
+			goto on_trap;
+		}
+		if (ra % SREGS == SR_ASID && v->sreg[SR_ASID] != rb)
+			profile_flush(v, 0, 1);
+		v->sreg[ra % SREGS] = rb;
+		break;
+	case 54: /* access register in the bank of the interrupted code */
+	case 55: {
+		if (bit_get(v->flags, PRIV) == 0) {
+			trap_addr = T_PRIV;
+			goto on_trap;
+		}
+		const uint8_t level = v->flags;
+		uint64_t *prev = bit_get(v->flags, SHADOW) && level ? v->bank[(level - 1) % 4] : v->r;
+		if (alu == 54)
+			nra = prev[ra % REGS];
+		else
+			prev[ra % REGS] = rb;
+		if (alu == 55 && prev == v->r && ra % REGS == a)
+			nra = rb; /* the write back must not undo the write */
+		break;
+	}
 	case 64: if (loadw(v, ra, &nra, READ)) goto trapped; break;
 	case 65: if (storew(v, ra, rb)) goto trapped; break;
 	case 66: { uint8_t byte = 0; if (loadb(v, ra, &byte)) goto trapped; nra = byte; } break;
 	case 67: if (storeb(v, ra, rb)) goto trapped; break;
 
-	case 80: trap_addr = ra; trap_val = rb; goto on_trap;
-	case 81: if (tlb_flush_single(v, ra, &nra)) goto on_trap; break;
+	case 80:
+		if (ra == T_HYPERCALL && v->hypercall && bit_get(v->flags, PRIV)) {
+			if (hypercall(v, rb))
+				goto trapped;
+			goto next;
+		}
+		trap_addr = ra;
+		trap_val = rb;
+		goto on_trap;
+	case 81: if (tlb_flush_single(v, ra, &nra)) goto trapped; break;
 	case 82: if (tlb_flush_all(v)) goto trapped; break;
 	case 83: {
 		if (bit_get(v->flags, PRIV) == 0) { 
@@ -556,16 +2348,34 @@ static int cpu(vm_t *v) {
 			goto on_trap; 
 		}
 		const int va = bit_get(ra, 15);
-		bit_clr(&nra, 15);
-		if (nra > NELEMS(v->tlb_va)) { 
+		const uint64_t i = ra & ~(1ull << 15);
+		if (i >= NELEMS(v->tlb_va)) { 
 			trap_addr = T_INST; 
 			goto on_trap; 
 		}
-		if (va) v->tlb_va[ra] = rb; else v->tlb_pa[ra] = rb;
+		if (va) v->tlb_va[i] = rb; else v->tlb_pa[i] = rb;
+		v->tlb_pte[i] = 0;
 		}
 		break;
+	case 84: if (tlb_flush_asid(v, ra)) goto trapped; break;
+	case 85: if (trap_return(v)) goto trapped; npc = ra; goto next;
+	case 86: v->wfi = 1; goto next; /* wait for interrupt */
+
+	case 96:  nra = addus8(ra, rb); break;
+	case 97:  nra = subus8(ra, rb); break;
+	case 98:  nra = addus16(ra, rb); break;
+	case 99:  nra = subus16(ra, rb); break;
+	case 100: nra = cmpeq8(ra, rb); break;
+	case 101: nra = cmpeq16(ra, rb); break;
+	case 102: nra = shuf8(ra, rb); break;
+	case 103: nra = zbyte(ra); break;
+	case 104: nra = hsum8(ra); break;
+	case 105: nra = hsum16(ra); break;
+
+	case 127: goto next; /* no operation, does not touch registers or flags */
 	default:
 		trap_addr = T_INST;
+		goto on_trap;
 	}
 
 	v->r[a] = nra;
@@ -582,6 +2392,533 @@ trapped:
 	return 1;
 }
 
+/* RV64IMA core with machine, supervisor and user modes and Sv39 paging,
+ * selected with '-R'. It shares RAM, devices and the timer with the native
+ * core: external interrupts are the interrupt controller's, the machine
+ * timer interrupt is latched when the timer at IO(1, 3) expires and cleared
+ * by writing it. Device registers must be accessed as whole words; there
+ * is no compressed instruction set, no misaligned access and one hart. */
+static void rv_flush(vm_t *v) {
+	assert(v);
+	memset(v->rv.tlb, 0, sizeof v->rv.tlb);
+}
+
+static void rv_trap(vm_t *v, uint64_t cause, uint64_t tval) {
+	assert(v);
+	rv_t *rv = &v->rv;
+	if (trace(v, "+trap,%"PRIx64",%"PRIx64",%"PRIx64",", (uint64_t)rv->priv, cause, tval) < 0)
+		return;
+	v->effects++;
+	const int interrupt = cause >> 63;
+	const uint64_t code = cause & 63ull, deleg = interrupt ? rv->mideleg : rv->medeleg;
+	if (rv->priv <= RV_S && ((deleg >> code) & 1ull)) {
+		rv->scause = cause;
+		rv->sepc = v->pc;
+		rv->stval = tval;
+		bit_cnd(&rv->mstatus, RV_SPIE, bit_get(rv->mstatus, RV_SIE));
+		bit_clr(&rv->mstatus, RV_SIE);
+		bit_cnd(&rv->mstatus, RV_SPP, rv->priv == RV_S);
+		v->pc = (rv->stvec & ~3ull) + ((rv->stvec & 1ull) && interrupt ? 4 * code : 0);
+		rv->priv = RV_S;
+	} else {
+		rv->mcause = cause;
+		rv->mepc = v->pc;
+		rv->mtval = tval;
+		bit_cnd(&rv->mstatus, RV_MPIE, bit_get(rv->mstatus, RV_MIE));
+		bit_clr(&rv->mstatus, RV_MIE);
+		rv->mstatus = (rv->mstatus & ~(3ull << RV_MPP)) | ((uint64_t)rv->priv << RV_MPP);
+		v->pc = (rv->mtvec & ~3ull) + ((rv->mtvec & 1ull) && interrupt ? 4 * code : 0);
+		rv->priv = RV_M;
+	}
+	rv_flush(v);
+}
+
+/* Raise the access, page or misaligned fault for a kind of access */
+static int rv_fault(vm_t *v, int rwx, int fault, uint64_t tval) {
+	assert(v);
+	static const uint64_t causes[3][3] = { /* misaligned, access, page */
+		[READ] = { 4, 5, 13, }, [WRITE] = { 6, 7, 15, }, [EXECUTE] = { 0, 1, 12, },
+	};
+	rv_trap(v, causes[rwx][fault], tval);
+	return 1;
+}
+
+enum { RV_MISALIGNED, RV_ACCESS, RV_PAGE, };
+
+static int rv_translate(vm_t *v, uint64_t va, uint64_t *pa, int rwx, int *virtual) {
+	assert(v);
+	assert(pa);
+	assert(virtual);
+	rv_t *rv = &v->rv;
+	int priv = rv->priv;
+	if (rwx != EXECUTE && bit_get(rv->mstatus, RV_MPRV))
+		priv = (rv->mstatus >> RV_MPP) & 3ull;
+	*pa = va;
+	*virtual = 0;
+	if (priv == RV_M || (rv->satp >> 60) != 8)
+		return 0;
+	*virtual = 1;
+	const uint64_t vpn = va >> 12, ppn_mask = (1ull << 44) - 1ull;
+	uint64_t *e = rv->tlb[rwx][vpn % RV_TLB];
+	if (e[0] == vpn + 1) {
+		*pa = e[1] | (va & 0xFFFull);
+		return 0;
+	}
+	if ((uint64_t)((int64_t)(va << 25) >> 25) != va)
+		return rv_fault(v, rwx, RV_PAGE, va);
+	uint64_t table = (rv->satp & ppn_mask) << 12, pte = 0, pte_addr = 0;
+	int level = 2;
+	for (;; level--) {
+		pte_addr = table + (((va >> (12 + (9 * level))) & 511ull) * sizeof (uint64_t));
+		if (bus_load(v, pte_addr, &pte) < 0)
+			return rv_fault(v, rwx, RV_ACCESS, va);
+		if (!bit_get(pte, PTE_V) || (!bit_get(pte, PTE_R) && bit_get(pte, PTE_W)))
+			return rv_fault(v, rwx, RV_PAGE, va);
+		if (bit_get(pte, PTE_R) || bit_get(pte, PTE_X))
+			break;
+		if (level == 0)
+			return rv_fault(v, rwx, RV_PAGE, va);
+		table = ((pte >> 10) & ppn_mask) << 12;
+	}
+	const uint64_t ppn = (pte >> 10) & ppn_mask, low = (1ull << (9 * level)) - 1ull;
+	if (ppn & low) /* misaligned superpage */
+		return rv_fault(v, rwx, RV_PAGE, va);
+	if (bit_get(pte, PTE_U) ? priv == RV_S && (rwx == EXECUTE || !bit_get(rv->mstatus, RV_SUM)) : priv == RV_U)
+		return rv_fault(v, rwx, RV_PAGE, va);
+	const int allowed = rwx == READ ? bit_get(pte, PTE_R) || (bit_get(pte, PTE_X) && bit_get(rv->mstatus, RV_MXR)) :
+		rwx == WRITE ? bit_get(pte, PTE_W) : bit_get(pte, PTE_X);
+	if (!allowed)
+		return rv_fault(v, rwx, RV_PAGE, va);
+	const uint64_t update = pte | (1ull << PTE_A) | (rwx == WRITE ? 1ull << PTE_D : 0);
+	if (update != pte && bus_store(v, pte_addr, update) < 0)
+		return rv_fault(v, rwx, RV_ACCESS, va);
+	*pa = (((ppn & ~low) | (vpn & low)) << 12) | (va & 0xFFFull);
+	e[0] = vpn + 1;
+	e[1] = *pa & ~0xFFFull;
+	return 0;
+}
+
+/* Loads of 'size' bytes, zero extended. A WRITE is the load of an atomic
+ * memory operation, which faults as a store. */
+static int rv_load(vm_t *v, uint64_t va, unsigned size, uint64_t *val, int rwx) {
+	assert(v);
+	assert(val);
+	uint64_t pa = 0, w = 0;
+	int virtual = 0;
+	if (va & (size - 1))
+		return rv_fault(v, rwx, RV_MISALIGNED, va);
+	if (rv_translate(v, va, &pa, rwx, &virtual))
+		return 1;
+	if (v->profile)
+		profile(v, va, pa, rwx == WRITE ? READ : rwx, virtual);
+	if (bus_load(v, pa & ~7ull, &w) < 0)
+		return rv_fault(v, rwx, RV_ACCESS, va);
+	w >>= (pa & 7ull) * CHAR_BIT;
+	*val = size == 8 ? w : w & ((1ull << (size * CHAR_BIT)) - 1ull);
+	return 0;
+}
+
+static int rv_store(vm_t *v, uint64_t va, unsigned size, uint64_t val) {
+	assert(v);
+	uint64_t pa = 0, w = 0;
+	int virtual = 0;
+	if (va & (size - 1))
+		return rv_fault(v, WRITE, RV_MISALIGNED, va);
+	if (rv_translate(v, va, &pa, WRITE, &virtual))
+		return 1;
+	if (v->profile)
+		profile(v, va, pa, WRITE, virtual);
+	if (size < 8) { /* partial words only within RAM, devices see whole words */
+		if (!within(pa, MEMORY_START, MEMORY_END(v)) || bus_load(v, pa & ~7ull, &w) < 0)
+			return rv_fault(v, WRITE, RV_ACCESS, va);
+		const unsigned shift = (pa & 7ull) * CHAR_BIT;
+		const uint64_t mask = ((1ull << (size * CHAR_BIT)) - 1ull) << shift;
+		val = (w & ~mask) | ((val << shift) & mask);
+	}
+	if (bus_store(v, pa & ~7ull, val) < 0)
+		return rv_fault(v, WRITE, RV_ACCESS, va);
+	return 0;
+}
+
+static inline uint64_t sext32(uint64_t x) { return (uint64_t)(int64_t)(int32_t)x; }
+
+#define RV_SSTATUS ((1ull << RV_SIE) | (1ull << RV_SPIE) | (1ull << RV_SPP) | (1ull << RV_SUM) | (1ull << RV_MXR))
+#define RV_MSTATUS (RV_SSTATUS | (1ull << RV_MIE) | (1ull << RV_MPIE) | (3ull << RV_MPP) | (1ull << RV_MPRV) | (1ull << RV_TVM) | (1ull << RV_TW) | (1ull << RV_TSR))
+#define RV_SINTS   ((1ull << RV_SSI) | (1ull << RV_STI) | (1ull << RV_SEI))
+#define RV_XLEN64  ((2ull << 32) | (2ull << 34)) /* user and supervisor modes are 64-bit, in 'mstatus' and 'sstatus' */
+
+static int rv_csr(vm_t *v, unsigned csr, uint64_t *val, int write) {
+	assert(v);
+	assert(val);
+	rv_t *rv = &v->rv;
+	uint64_t *reg = NULL, mask = ~0ull, view = ~0ull, old = 0; /* 'view' is the part of 'reg' visible */
+	if (((csr >> 8) & 3u) > (unsigned)rv->priv || (write && (csr >> 10) == 3u))
+		return -1;
+	switch (csr) {
+	case 0xC00: case 0xC02: case 0xB00: case 0xB02: old = v->icount; reg = &old; mask = 0; break; /* cycle, instret */
+	case 0xC01: old = v->rv.mtime; reg = &old; mask = 0; break; /* time */
+	case 0xF11: case 0xF12: case 0xF13: case 0xF14: reg = &old; mask = 0; break; /* vendor, architecture, implementation, hart */
+	case 0x301: old = (2ull << 62) | 1ull /* A */ | (1ull << 8) /* I */ | (1ull << 12) /* M */ | (1ull << 18) /* S */ | (1ull << 20) /* U */; reg = &old; mask = 0; break;
+	case 0x300:
+		if (write && ((*val >> RV_MPP) & 3ull) == 2ull) /* reserved, keep user mode */
+			*val &= ~(3ull << RV_MPP);
+		reg = &rv->mstatus;
+		mask = RV_MSTATUS;
+		break;
+	case 0x100: reg = &rv->mstatus; mask = view = RV_SSTATUS; break;
+	case 0x302: reg = &rv->medeleg; mask = 0xB3FFull & ~(1ull << 11); break; /* machine calls are never delegated */
+	case 0x303: reg = &rv->mideleg; mask = RV_SINTS; break;
+	case 0x304: reg = &rv->mie; mask = 0xAAAull; break;
+	case 0x344: reg = &rv->mip; mask = RV_SINTS; break;
+	case 0x104: reg = &rv->mie; mask = view = rv->mideleg; break;
+	case 0x144: reg = &rv->mip; view = rv->mideleg; mask = rv->mideleg & (1ull << RV_SSI); break;
+	case 0x305: reg = &rv->mtvec; mask = ~2ull; break;
+	case 0x340: reg = &rv->mscratch; break;
+	case 0x341: reg = &rv->mepc; mask = ~3ull; break;
+	case 0x342: reg = &rv->mcause; break;
+	case 0x343: reg = &rv->mtval; break;
+	case 0x105: reg = &rv->stvec; mask = ~2ull; break;
+	case 0x140: reg = &rv->sscratch; break;
+	case 0x141: reg = &rv->sepc; mask = ~3ull; break;
+	case 0x142: reg = &rv->scause; break;
+	case 0x143: reg = &rv->stval; break;
+	case 0x180:
+		if (rv->priv == RV_S && bit_get(rv->mstatus, RV_TVM))
+			return -1;
+		reg = &rv->satp;
+		if (write && (*val >> 60) != 0 && (*val >> 60) != 8)
+			mask = 0; /* unsupported modes are ignored */
+		break;
+	case 0x306: case 0x106: case 0x320: reg = &old; mask = 0; break; /* counter enables and inhibit, all counters available */
+	default:
+		if (csr >= 0x3A0 && csr <= 0x3EF) { /* no physical memory protection, configuration reads as zero */
+			reg = &old;
+			mask = 0;
+			break;
+		}
+		return -1;
+	}
+	const uint64_t r = (*reg & view) | (csr == 0x300 || csr == 0x100 ? RV_XLEN64 : 0);
+	if (write) {
+		*reg = (*reg & ~mask) | (*val & mask);
+		if (csr == 0x300 || csr == 0x100 || csr == 0x180)
+			rv_flush(v);
+		if (csr == 0x180 && *reg != r)
+			profile_flush(v, 0, 1);
+	}
+	*val = r;
+	return 0;
+}
+
+static int rv_system(vm_t *v, uint32_t in, uint64_t *npc, uint64_t *r) {
+	assert(v);
+	assert(npc);
+	assert(r);
+	rv_t *rv = &v->rv;
+	const unsigned f3 = (in >> 12) & 7u, rs1 = (in >> 15) & 31u;
+	if (f3 == 0) {
+		if (in == 0x00000073u) { /* ecall */
+			rv_trap(v, 8 + rv->priv, 0);
+			return 1;
+		}
+		if (in == 0x00100073u) { /* ebreak */
+			rv_trap(v, 3, v->pc);
+			return 1;
+		}
+		if (in == 0x30200073u && rv->priv == RV_M) { /* mret */
+			const int mpp = (rv->mstatus >> RV_MPP) & 3ull;
+			bit_cnd(&rv->mstatus, RV_MIE, bit_get(rv->mstatus, RV_MPIE));
+			bit_set(&rv->mstatus, RV_MPIE);
+			rv->mstatus &= ~(3ull << RV_MPP);
+			if (mpp != RV_M)
+				bit_clr(&rv->mstatus, RV_MPRV);
+			rv->priv = mpp;
+			*npc = rv->mepc;
+			rv_flush(v);
+			return 0;
+		}
+		if (in == 0x10200073u && (rv->priv == RV_M || (rv->priv == RV_S && !bit_get(rv->mstatus, RV_TSR)))) { /* sret */
+			const int spp = bit_get(rv->mstatus, RV_SPP);
+			bit_cnd(&rv->mstatus, RV_SIE, bit_get(rv->mstatus, RV_SPIE));
+			bit_set(&rv->mstatus, RV_SPIE);
+			bit_clr(&rv->mstatus, RV_SPP);
+			bit_clr(&rv->mstatus, RV_MPRV);
+			rv->priv = spp ? RV_S : RV_U;
+			*npc = rv->sepc;
+			rv_flush(v);
+			return 0;
+		}
+		if (in == 0x10500073u && (rv->priv == RV_M || !bit_get(rv->mstatus, RV_TW))) { /* wfi */
+			v->wfi = !(rv->mip & rv->mie);
+			return 0;
+		}
+		if ((in >> 25) == 0x09u && ((in >> 7) & 31u) == 0 && rv->priv >= RV_S && !(rv->priv == RV_S && bit_get(rv->mstatus, RV_TVM))) { /* sfence.vma */
+			const unsigned rs1 = (in >> 15) & 31u;
+			profile_flush(v, rv->x[rs1], !rs1);
+			rv_flush(v);
+			return 0;
+		}
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	if (f3 == 4) {
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	const unsigned op = f3 & 3u;
+	const uint64_t src = f3 & 4u ? rs1 : rv->x[rs1];
+	uint64_t val = src, old = 0;
+	if (rv_csr(v, in >> 20, &old, 0) < 0) {
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	if (op == 2) val = old | src;
+	if (op == 3) val = old & ~src;
+	if ((op == 1 || rs1) && rv_csr(v, in >> 20, &val, 1) < 0) {
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	*r = old;
+	return 0;
+}
+
+static int rv_amo(vm_t *v, uint32_t in, uint64_t *r) {
+	assert(v);
+	assert(r);
+	rv_t *rv = &v->rv;
+	const unsigned f3 = (in >> 12) & 7u, f5 = in >> 27;
+	if (f3 != 2 && f3 != 3) {
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	const unsigned size = f3 == 2 ? 4 : 8;
+	const uint64_t addr = rv->x[(in >> 15) & 31u], b = rv->x[(in >> 20) & 31u];
+	uint64_t old = 0, val = 0;
+	if (f5 == 0x02) { /* load reserved */
+		if (rv_load(v, addr, size, &old, READ))
+			return 1;
+		rv->reservation = addr + 1;
+		*r = size == 4 ? sext32(old) : old;
+		return 0;
+	}
+	if (f5 == 0x03) { /* store conditional */
+		const int held = rv->reservation == addr + 1;
+		rv->reservation = 0;
+		if (held && rv_store(v, addr, size, b))
+			return 1;
+		*r = !held;
+		return 0;
+	}
+	if (rv_load(v, addr, size, &old, WRITE))
+		return 1;
+	const uint64_t x = size == 4 ? sext32(old) : old, y = size == 4 ? sext32(b) : b;
+	switch (f5) {
+	case 0x01: val = y; break;
+	case 0x00: val = x + y; break;
+	case 0x04: val = x ^ y; break;
+	case 0x0C: val = x & y; break;
+	case 0x08: val = x | y; break;
+	case 0x10: val = (int64_t)x < (int64_t)y ? x : y; break;
+	case 0x14: val = (int64_t)x > (int64_t)y ? x : y; break;
+	case 0x18: val = (size == 4 ? (uint32_t)x < (uint32_t)y : x < y) ? x : y; break;
+	case 0x1C: val = (size == 4 ? (uint32_t)x > (uint32_t)y : x > y) ? x : y; break;
+	default:
+		rv_trap(v, 2, in);
+		return 1;
+	}
+	if (rv_store(v, addr, size, val))
+		return 1;
+	*r = x;
+	return 0;
+}
+
+static inline uint64_t rv_div(uint64_t a, uint64_t b, unsigned f3, int word) {
+	if (word) { /* operate on the low 32 bits, sign extending the result */
+		const int32_t sa = a, sb = b;
+		const uint32_t ua = a, ub = b;
+		switch (f3) {
+		case 4: return sext32(!sb ? ~0u : sa == INT32_MIN && sb == -1 ? (uint32_t)sa : (uint32_t)(sa / sb));
+		case 5: return sext32(!ub ? ~0u : ua / ub);
+		case 6: return sext32(!sb ? (uint32_t)sa : sb == -1 ? 0 : (uint32_t)(sa % sb));
+		default: return sext32(!ub ? ua : ua % ub);
+		}
+	}
+	const int64_t sa = a, sb = b;
+	switch (f3) {
+	case 4: return !b ? ~0ull : sa == INT64_MIN && sb == -1 ? a : (uint64_t)(sa / sb);
+	case 5: return !b ? ~0ull : a / b;
+	case 6: return !b ? a : sb == -1 ? 0 : (uint64_t)(sa % sb);
+	default: return !b ? a : a % b;
+	}
+}
+
+static ALWAYS_INLINE int rv_cpu(vm_t *v, const int traced) {
+	assert(v);
+	rv_t *rv = &v->rv;
+	uint64_t instr = 0, npc = v->pc + 4, r = 0;
+	if (v->pc & 3ull)
+		return rv_fault(v, EXECUTE, RV_MISALIGNED, v->pc);
+	if (rv_load(v, v->pc, 4, &instr, EXECUTE))
+		return 1;
+	if (traced && trace(v, "+pc,%"PRIx64",%"PRIx64",0,", v->pc, instr) < 0)
+		return -1;
+	const uint32_t in = instr;
+	const unsigned rd = (in >> 7) & 31u, f3 = (in >> 12) & 7u, f7 = in >> 25;
+	const uint64_t a = rv->x[(in >> 15) & 31u], b = rv->x[(in >> 20) & 31u];
+	const uint64_t imm_i = (uint64_t)((int64_t)(int32_t)in >> 20);
+	const uint64_t imm_s = (imm_i & ~31ull) | rd;
+	const uint64_t imm_b = (uint64_t)((int64_t)(int32_t)(in & 0x80000000u) >> 19) | ((in << 4) & 0x800u) | ((in >> 20) & 0x7E0u) | ((in >> 7) & 0x1Eu);
+	const uint64_t imm_u = sext32(in & 0xFFFFF000u);
+	const uint64_t imm_j = (uint64_t)((int64_t)(int32_t)(in & 0x80000000u) >> 11) | (in & 0xFF000u) | ((in >> 9) & 0x800u) | ((in >> 20) & 0x7FEu);
+	int write = 1;
+	switch (in & 0x7Fu) {
+	case 0x37: r = imm_u; break; /* lui */
+	case 0x17: r = v->pc + imm_u; break; /* auipc */
+	case 0x6F: r = npc; npc = v->pc + imm_j; break; /* jal */
+	case 0x67: /* jalr */
+		if (f3)
+			goto illegal;
+		r = npc;
+		npc = (a + imm_i) & ~1ull;
+		break;
+	case 0x63: { /* branches */
+		int taken = 0;
+		switch (f3) {
+		case 0: taken = a == b; break;
+		case 1: taken = a != b; break;
+		case 4: taken = (int64_t)a < (int64_t)b; break;
+		case 5: taken = (int64_t)a >= (int64_t)b; break;
+		case 6: taken = a < b; break;
+		case 7: taken = a >= b; break;
+		default: goto illegal;
+		}
+		if (taken)
+			npc = v->pc + imm_b;
+		write = 0;
+		break;
+	}
+	case 0x03: /* loads */
+		if (f3 == 7)
+			goto illegal;
+		if (rv_load(v, a + imm_i, 1u << (f3 & 3u), &r, READ))
+			return 1;
+		if (f3 < 4 && f3 != 3) {
+			const unsigned shift = 64 - (8u << f3);
+			r = (uint64_t)((int64_t)(r << shift) >> shift);
+		}
+		break;
+	case 0x23: /* stores */
+		if (f3 > 3)
+			goto illegal;
+		if (rv_store(v, a + imm_s, 1u << f3, b))
+			return 1;
+		write = 0;
+		break;
+	case 0x13: /* arithmetic with an immediate */
+		switch (f3) {
+		case 0: r = a + imm_i; break;
+		case 1: if (f7 >> 1) goto illegal; r = a << (imm_i & 63u); break;
+		case 2: r = (int64_t)a < (int64_t)imm_i; break;
+		case 3: r = a < imm_i; break;
+		case 4: r = a ^ imm_i; break;
+		case 5:
+			if ((f7 >> 1) & ~0x10u)
+				goto illegal;
+			r = f7 & 0x20u ? asr(a, imm_i & 63u) : a >> (imm_i & 63u);
+			break;
+		case 6: r = a | imm_i; break;
+		case 7: r = a & imm_i; break;
+		}
+		break;
+	case 0x1B: /* 32-bit arithmetic with an immediate */
+		switch (f3) {
+		case 0: r = sext32(a + imm_i); break;
+		case 1: if (f7) goto illegal; r = sext32(a << (imm_i & 31u)); break;
+		case 5:
+			if (f7 & ~0x20u)
+				goto illegal;
+			r = f7 ? sext32((uint64_t)((int32_t)a >> (imm_i & 31u))) : sext32((uint32_t)a >> (imm_i & 31u));
+			break;
+		default: goto illegal;
+		}
+		break;
+	case 0x33: /* arithmetic */
+		if (f7 == 1) {
+			switch (f3) {
+			case 0: r = a * b; break;
+			case 1: r = mulhs(a, b); break;
+			case 2: r = mulhu(a, b) - ((int64_t)a < 0 ? b : 0); break;
+			case 3: r = mulhu(a, b); break;
+			default: r = rv_div(a, b, f3, 0); break;
+			}
+			break;
+		}
+		if (f7 & ~0x20u || (f7 && f3 != 0 && f3 != 5))
+			goto illegal;
+		switch (f3) {
+		case 0: r = f7 ? a - b : a + b; break;
+		case 1: r = a << (b & 63u); break;
+		case 2: r = (int64_t)a < (int64_t)b; break;
+		case 3: r = a < b; break;
+		case 4: r = a ^ b; break;
+		case 5: r = f7 ? asr(a, b & 63u) : a >> (b & 63u); break;
+		case 6: r = a | b; break;
+		case 7: r = a & b; break;
+		}
+		break;
+	case 0x3B: /* 32-bit arithmetic */
+		if (f7 == 1) {
+			if (f3 == 0)
+				r = sext32(a * b);
+			else if (f3 >= 4)
+				r = rv_div(a, b, f3, 1);
+			else
+				goto illegal;
+			break;
+		}
+		if (f7 & ~0x20u || (f7 && f3 != 0 && f3 != 5))
+			goto illegal;
+		switch (f3) {
+		case 0: r = sext32(f7 ? a - b : a + b); break;
+		case 1: r = sext32(a << (b & 31u)); break;
+		case 5: r = f7 ? sext32((uint64_t)((int32_t)a >> (b & 31u))) : sext32((uint32_t)a >> (b & 31u)); break;
+		default: goto illegal;
+		}
+		break;
+	case 0x0F: write = 0; break; /* fence and fence.i, accesses are already in order */
+	case 0x73:
+		if (rv_system(v, in, &npc, &r))
+			return 1;
+		break;
+	case 0x2F:
+		if (rv_amo(v, in, &r))
+			return 1;
+		break;
+	default:
+		goto illegal;
+	}
+	if (write && rd)
+		rv->x[rd] = r;
+	v->pc = npc;
+	return 0;
+illegal:
+	rv_trap(v, 2, in);
+	return 1;
+}
+
+/* Advance the timer and service host devices, for either core */
+static void devices(vm_t *v) {
+	assert(v);
+	v->tick++;
+	v->rv.mtime++;
+	if (io_wanted(v))
+		io_poll(v);
+	if ((v->irq_enable & ((1ull << IRQ_UART_RX) | (1ull << IRQ_SHM))) && ++v->poll >= UART_POLL) {
+		v->poll = 0;
+		input_poll(v);
+	}
+}
+
 static int interrupt(vm_t *v) {
 	assert(v);
 	if (v->timer && v->tick >= v->timer) {
@@ -589,42 +2926,749 @@ static int interrupt(vm_t *v) {
 		if (bit_get(v->flags, INTR) == 0)
 			return trap(v, T_TIMER, v->timer);
 	}
-	v->tick++;
+	devices(v);
+	if ((v->irq_pending & v->irq_enable) && bit_get(v->flags, INTR) == 0)
+		if (irq_next(v) != IRQ_NONE)
+			return trap(v, T_EXTERNAL, 0);
 	return 0;
 }
 
+/* Park the CPU after a wait-for-interrupt until a source could fire. The
+ * host sleeps rather than executes, guest time advancing at TICKS_PER_MS. If
+ * nothing could ever wake the CPU the wait does nothing. */
+static int idle(vm_t *v) {
+	assert(v);
+	v->wfi = 0;
+	if (irq_next(v) != IRQ_NONE)
+		return 0;
+	if (!v->timer && !uart_wanted(v) && !shm_wanted(v) && !io_wanted(v))
+		return 0;
+	const uint64_t remaining = v->timer ? (v->timer > v->tick ? v->timer - v->tick : 0) : UINT64_MAX;
+	const uint64_t elapsed = doze(v, remaining, 1, 0);
+	v->tick += elapsed;
+	v->rv.mtime += elapsed;
+	return 0;
+}
+
+static int rv_interrupt(vm_t *v) {
+	assert(v);
+	rv_t *rv = &v->rv;
+	if (v->timer && v->tick >= v->timer) {
+		v->tick = 0;
+		rv->mip |= 1ull << RV_MTI;
+	}
+	devices(v);
+	bit_cnd(&rv->mip, RV_MEI, (v->irq_pending & v->irq_enable) && irq_next(v) != IRQ_NONE);
+	const uint64_t pending = rv->mip & rv->mie;
+	if (!pending)
+		return 0;
+	const uint64_t m = pending & ~rv->mideleg, s = pending & rv->mideleg;
+	const int menable = rv->priv < RV_M || bit_get(rv->mstatus, RV_MIE);
+	const int senable = rv->priv < RV_S || (rv->priv == RV_S && bit_get(rv->mstatus, RV_SIE));
+	const uint64_t take = menable && m ? m : senable && s ? s : 0;
+	static const unsigned order[] = { RV_MEI, RV_MSI, RV_MTI, RV_SEI, RV_SSI, RV_STI, };
+	for (size_t i = 0; take && i < NELEMS(order); i++) {
+		if (take & (1ull << order[i])) {
+			rv_trap(v, (1ull << 63) | order[i], 0);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static void loop_skip(vm_t *v);
+
+/* Specialised run loops for each core with and without instruction tracing,
+ * the guest writing bit 0 of 'tron' at IO(1, 1) ends one so 'run' can pick
+ * another */
+#define RUN(NAME, INTERRUPT, CPU, TRACED) \
+static int NAME(vm_t *v, uint64_t step, uint64_t *i) { \
+	assert(v); \
+	assert(i); \
+	for (; (*i < step || !step) && !v->halt && !v->stop && !v->retrace; (*i)++) { \
+		if (v->wfi && idle(v) < 0) \
+			return -1; \
+		if (INTERRUPT(v) < 0) \
+			return -1; \
+		if (CPU(v, TRACED) < 0) \
+			return -1; \
+		v->icount++; \
+		if (v->loop.skip) \
+			loop_skip(v); \
+	} \
+	return 0; \
+}
+
+/* Probes run the loop body without devices, only the clock moving */
+static inline int probe_tick(vm_t *v) { assert(v); v->tick++; return 0; }
+
+RUN(run_probe, probe_tick, cpu, 0)
+
+typedef struct {
+	uint64_t pc, flags, tick, icount, effects, *r, r0[REGS], saved[4], bank[4][REGS];
+	int halt, profile;
+} probe_t; /* CPU state restored after probing a loop */
+
+static void probe_save(vm_t *v, probe_t *p) {
+	assert(v);
+	assert(p);
+	p->pc = v->pc;
+	p->flags = v->flags;
+	p->tick = v->tick;
+	p->icount = v->icount;
+	p->effects = v->effects;
+	p->r = v->r;
+	memcpy(p->r0, v->r, sizeof p->r0);
+	memcpy(p->saved, v->saved, sizeof p->saved);
+	memcpy(p->bank, v->bank, sizeof p->bank);
+	p->halt = v->halt;
+	p->profile = v->profile;
+}
+
+static void probe_restore(vm_t *v, const probe_t *p) {
+	assert(v);
+	assert(p);
+	v->pc = p->pc;
+	v->flags = p->flags;
+	v->tick = p->tick;
+	v->icount = p->icount;
+	v->effects = p->effects;
+	v->r = p->r;
+	memcpy(v->saved, p->saved, sizeof v->saved);
+	memcpy(v->bank, p->bank, sizeof v->bank);
+	v->halt = p->halt;
+	v->profile = p->profile;
+}
+
+/* Probes only run loops made of ALU operations, jumps, flag accesses and
+ * loads, nothing that could store, trap on purpose or change the MMU */
+static int loop_pure(vm_t *v) {
+	assert(v);
+	for (uint64_t pc = v->loop.head & ~7ull; pc <= v->loop.tail; pc += sizeof (uint64_t)) {
+		uint64_t instr = 0;
+		if (loadw(v, pc, &instr, EXECUTE))
+			return 0;
+		const uint32_t op = instr >> 32, half[] = { op, (uint32_t)instr, };
+		for (size_t i = 0; i < (op & COMPACT ? 2u : 1u); i++) {
+			const unsigned alu = op & COMPACT ? (half[i] >> 20) & 0x7Ful : (op >> 16) & 0xFFul;
+			if (alu > 33 && alu != 48 && alu != 49 && alu != 64 && alu != 66 && alu != 127)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Run iteration 'k' from the state at the loop head, extrapolated, and
+ * report if it comes back round as predicted rather than leaving the loop */
+static int loop_probe(vm_t *v, const probe_t *p, uint64_t k) {
+	assert(v);
+	assert(p);
+	loop_t *l = &v->loop;
+	probe_restore(v, p);
+	v->profile = 0;
+	for (size_t j = 0; j < REGS; j++)
+		v->r[j] += k * l->d[j];
+	v->tick += k * l->len;
+	v->icount += k * l->len;
+	uint64_t i = 0;
+	if (run_probe(v, l->len, &i) < 0 || i != l->len || v->halt || v->pc != p->pc || v->r != p->r || v->flags != p->flags || v->effects != p->effects)
+		return 0;
+	for (size_t j = 0; j < REGS; j++)
+		if (v->r[j] != p->r0[j] + ((k + 1) * l->d[j]))
+			return 0;
+	return 1;
+}
+
+/* A loop polling 'tick' differs each time round, but if it has no side
+ * effects and its registers change by the same amount each iteration the
+ * iteration it leaves on can be found by running single iterations further
+ * ahead, galloping then bisecting, on the assumption that once it would
+ * leave it would also leave later, as with 'tick' reaching a deadline. All
+ * iterations before that one are skipped with the host sleeping as for an
+ * idle loop, so 'tick' reads the same on leaving as it would have if every
+ * iteration was executed. */
+static void loop_skip(vm_t *v) {
+	assert(v);
+	loop_t *l = &v->loop;
+	l->skip = 0;
+	const int next = v->pc == l->head && v->icount - l->visit == l->len;
+	int affine = next && l->deltas;
+	for (size_t j = 0; j < REGS; j++) {
+		const uint64_t d = v->r[j] - l->at[j];
+		affine &= d == l->d[j];
+		l->d[j] = d;
+		l->at[j] = v->r[j];
+	}
+	l->deltas = next;
+	l->visit = v->icount;
+	if (!affine || (v->timer && v->timer <= v->tick))
+		return;
+	const uint64_t remaining = v->timer ? v->timer - v->tick : UINT64_MAX - v->tick;
+	if (remaining / l->len < 3)
+		return;
+	const uint64_t max = (remaining / l->len) - 1; /* the last probe ends before the deadline */
+	probe_t p;
+	probe_save(v, &p);
+	l->probing = 1;
+	v->profile = 0;
+	uint64_t good = 0, bad = max + 1; /* skipping 'good' iterations is safe, 'bad' is not */
+	if (loop_pure(v)) {
+		for (uint64_t k = 1; good < max && bad > max; k = k > max / 2 ? max : k * 2) {
+			if (loop_probe(v, &p, k - 1))
+				good = k;
+			else
+				bad = k;
+		}
+		while (bad <= max && bad - good > 1) {
+			const uint64_t k = good + ((bad - good) / 2);
+			if (loop_probe(v, &p, k - 1))
+				good = k;
+			else
+				bad = k;
+		}
+	}
+	probe_restore(v, &p);
+	l->probing = 0;
+	if (!good)
+		return;
+	const uint64_t skip = doze(v, good * l->len, l->len, 0) / l->len;
+	for (size_t j = 0; j < REGS; j++)
+		v->r[j] += skip * l->d[j];
+	memcpy(l->at, v->r, sizeof l->at);
+	v->tick += skip * l->len;
+	v->rv.mtime += skip * l->len;
+	v->icount += skip * l->len;
+	l->icount += skip * l->len;
+	l->visit = v->icount;
+}
+
+RUN(run_untraced, interrupt, cpu, 0)
+RUN(run_traced, interrupt, cpu, 1)
+RUN(run_riscv, rv_interrupt, rv_cpu, 0)
+RUN(run_riscv_traced, rv_interrupt, rv_cpu, 1)
+
 static int run(vm_t *v, uint64_t step) {
 	assert(v);
-	int forever = step == 0;
-	for (uint64_t i = 0; (i < step || forever) && !v->halt; i++) {
-		if (interrupt(v) < 0)
+	static int (*const loops[2][2])(vm_t *v, uint64_t step, uint64_t *i) = {
+		{ run_untraced, run_traced, }, { run_riscv, run_riscv_traced, },
+	};
+	uint64_t i = 0;
+	do {
+		v->retrace = 0;
+		if (loops[!!v->riscv][bit_get(v->tron, 0) && v->trace](v, step, &i) < 0)
 			return -1;
-		if (cpu(v) < 0)
+	} while (v->retrace);
+	return v->halt;
+}
+
+static int vm_init(vm_t *v, uint64_t msize, int huge) {
+	assert(v);
+	v->pc = MEMORY_START;
+	bit_set(&v->flags, PRIV); /* reset into privileged mode */
+	v->r = v->bank[0];
+	v->fast = 1;
+	v->trace = stderr;
+	v->msize = msize;
+	v->rv.priv = RV_M;
+	if (!(v->m = ram_alloc(msize, huge)) || !(v->touched = ram_alloc(bitmap_size(v), 0)) || !(v->dirty = ram_alloc(bitmap_size(v), 0)))
+		return -1;
+	return 0;
+}
+
+/* Library interface, see 'vm.h' */
+vm_t *vm_create(uint64_t memory) {
+	vm_t *v = calloc(1, sizeof *v);
+	if (!v)
+		return NULL;
+	memory = memory ? memory : SIZE;
+	if (memory < PAGE_SIZE || memory > MEMORY_MAX || (memory & PAGE_MASK) || vm_init(v, memory, 0) < 0) {
+		vm_destroy(v);
+		return NULL;
+	}
+	return v;
+}
+
+void vm_destroy(vm_t *v) {
+	if (!v)
+		return;
+	io_stop(v);
+	restore(&v->console.terminal);
+	ram_free(v->m, v->msize);
+	ram_free(v->touched, bitmap_size(v));
+	ram_free(v->dirty, bitmap_size(v));
+	ram_free(v->heat.count, heat_size(v));
+	cache_sim_fini(&v->sim);
+	if (v->access)
+		(void)fclose(v->access);
+	if (v->random)
+		(void)fclose(v->random);
+	if (v->journal.f)
+		(void)fclose(v->journal.f);
+	hostfs_fini(&v->hostfs);
+	shm_fini(&v->shm);
+	free(v);
+}
+
+int vm_load(vm_t *v, const void *image, size_t len) {
+	assert(v);
+	assert(image);
+	if (len > v->msize)
+		return -1;
+	memcpy(v->m, image, len);
+	v->loaded = len;
+	return 0;
+}
+
+int vm_run(vm_t *v, uint64_t budget) {
+	assert(v);
+	v->stop = 0;
+	if (run(v, budget) < 0 || v->halt < 0)
+		return -1;
+	return v->halt ? VM_HALTED : v->stop ? VM_STOPPED : VM_BUDGET;
+}
+
+static uint64_t *rv_register(vm_t *v, unsigned reg) { /* NULL if there is no such register */
+	assert(v);
+	if (reg < REGS)
+		return &v->rv.x[reg];
+	if (reg >= VM_RV_X && reg < VM_RV_X + 32u)
+		return &v->rv.x[reg - VM_RV_X];
+	return NULL;
+}
+
+int vm_get_register(vm_t *v, unsigned reg, uint64_t *val) {
+	assert(v);
+	assert(val);
+	switch (reg) {
+	case VM_PC: *val = v->pc; return 0;
+	case VM_FLAGS: *val = v->riscv ? (uint64_t)v->rv.priv : v->flags; return 0;
+	}
+	if (v->riscv) {
+		const uint64_t *x = rv_register(v, reg);
+		if (!x)
 			return -1;
+		*val = *x;
+		return 0;
 	}
-	return v->halt;
+	if (reg >= REGS)
+		return -1;
+	*val = v->r[reg];
+	return 0;
+}
+
+int vm_set_register(vm_t *v, unsigned reg, uint64_t val) {
+	assert(v);
+	switch (reg) {
+	case VM_PC: v->pc = val; return 0;
+	case VM_FLAGS:
+		if (!v->riscv) {
+			v->flags = val;
+			(void)bank_select(v);
+			return 0;
+		}
+		if (val != RV_U && val != RV_S && val != RV_M)
+			return -1;
+		v->rv.priv = val;
+		rv_flush(v);
+		return 0;
+	}
+	if (v->riscv) {
+		uint64_t *x = rv_register(v, reg);
+		if (!x)
+			return -1;
+		if (x != &v->rv.x[0]) /* x0 is always zero */
+			*x = val;
+		return 0;
+	}
+	if (reg >= REGS)
+		return -1;
+	v->r[reg] = val;
+	return 0;
+}
+
+int vm_read(vm_t *v, uint64_t addr, void *buf, size_t len) {
+	assert(v);
+	assert(buf);
+	const uint8_t *p = phy_ptr(v, addr, len);
+	if (!p)
+		return -1;
+	memcpy(buf, p, len);
+	return 0;
+}
+
+int vm_write(vm_t *v, uint64_t addr, const void *buf, size_t len) {
+	assert(v);
+	assert(buf);
+	uint8_t *p = phy_ptr(v, addr, len);
+	if (!p)
+		return -1;
+	memcpy(p, buf, len);
+	if (len)
+		dirty_mark(v, addr, len);
+	return 0;
+}
+
+int vm_mmio(vm_t *v, unsigned page, vm_read_t read, vm_write_t write, void *param) {
+	assert(v);
+	if (page < VM_MMIO_FIRST || page >= (IO_END - IO_START) / PAGE_SIZE)
+		return -1;
+	mmio_t *slot = NULL;
+	for (size_t i = 0; i < NELEMS(v->mmio); i++) {
+		mmio_t *d = &v->mmio[i];
+		if (d->page == page || (!slot && !d->read && !d->write))
+			slot = d;
+		if (d->page == page)
+			break;
+	}
+	if (!slot)
+		return -1;
+	*slot = (mmio_t) { .page = page, .read = read, .write = write, .param = param, };
+	return 0;
+}
+
+int vm_interrupt(vm_t *v, unsigned irq) {
+	assert(v);
+	if (irq == IRQ_NONE || irq >= IRQS)
+		return -1;
+	irq_raise(v, irq);
+	return 0;
+}
+
+int vm_hostfs(vm_t *v, const char *dir) {
+	assert(v);
+	assert(dir);
+	hostfs_fini(&v->hostfs);
+	return hostfs_init(&v->hostfs, dir);
+}
+
+int vm_shm(vm_t *v, const char *name, int in, int out) {
+	assert(v);
+	assert(name);
+	shm_fini(&v->shm);
+	if (shm_init(&v->shm, name, SHM_SIZE) < 0)
+		return -1;
+	return in < 0 && out < 0 ? 0 : shm_notifiers(&v->shm, in, out);
+}
+
+int vm_heatmap(vm_t *v, const char *file, uint64_t period) {
+	assert(v);
+	assert(file);
+	return heat_init(v, file, period ? period : 1);
+}
+
+int vm_heatmap_write(vm_t *v) {
+	assert(v);
+	return v->heat.count ? heat_write(v, v->heat.file) : -1;
+}
+
+int vm_riscv(vm_t *v) {
+	assert(v);
+	if (v->icount)
+		return -1;
+	v->riscv = 1;
+	return 0;
+}
+
+int vm_console(vm_t *v, vm_getch_t getch, vm_putch_t putch, void *param) {
+	assert(v);
+	if (v->io.on)
+		return -1;
+	v->console.getch = getch;
+	v->console.putch = putch;
+	v->console.param = param;
+	return 0;
+}
+
+int vm_threads(vm_t *v, int on) {
+	assert(v);
+	if (!on || v->io.on) {
+		if (!on)
+			io_stop(v);
+		return 0;
+	}
+	return !THREADS || v->journal.mode != J_OFF ? -1 : io_start(v);
+}
+
+uint64_t vm_instructions(vm_t *v) { assert(v); return v->icount; }
+uint64_t vm_status(vm_t *v) { assert(v); return v->status; }
+
+#ifndef VM_NO_MAIN
+static int delta_read(vm_t *v, FILE *f) {
+	assert(v);
+	assert(f);
+	uint64_t header[2] = { 0, }, addr = 0;
+	if (fread(header, 1, sizeof header, f) != sizeof header || header[0] != DELTA_MAGIC || header[1] != PAGE_SIZE)
+		return -1;
+	while (fread(&addr, 1, sizeof addr, f) == sizeof addr) {
+		if ((addr & PAGE_MASK) || addr >= v->msize)
+			return -1;
+		if (fread(((uint8_t*)v->m) + addr, 1, PAGE_SIZE, f) != PAGE_SIZE)
+			return -1;
+		dirty_mark(v, MEMORY_START + addr, PAGE_SIZE);
+	}
+	return ferror(f) ? -1 : 0;
+}
+
+
+/* Append a line of "image,operations,instructions,nanoseconds,instructions
+ * per second,nanoseconds per operation" to 'file' for tracking performance,
+ * an operation being whatever the image does 'ops' times, or an instruction
+ * if that is zero */
+static int bench(vm_t *v, const char *file, const char *image, uint64_t ops, uint64_t ns) {
+	assert(v);
+	assert(file);
+	assert(image);
+	FILE *f = fopen(file, "ab");
+	if (!f)
+		return -1;
+	ops = ops ? ops : v->icount;
+	const double s = ns ? ns / 1e9 : 1e-9, n = v->icount ? (double)v->icount : 1.0, o = ops ? (double)ops : 1.0;
+	const int r = fprintf(f, "%s,%"PRIu64",%"PRIu64",%"PRIu64",%.0f,%.3f\n", image, ops, v->icount, ns, n / s, ns / o);
+	if (fclose(f) < 0 || r < 0)
+		return -1;
+	return 0;
+}
+
+static int journal_open(journal_t *j, const char *name, int record) {
+	assert(j);
+	assert(name);
+	uint64_t magic = JOURNAL_MAGIC;
+	if (j->f || !(j->f = fopen(name, record ? "wb" : "rb")))
+		return -1;
+	j->mode = record ? J_RECORD : J_REPLAY;
+	if (record)
+		return fwrite(&magic, 1, sizeof magic, j->f) == sizeof magic ? 0 : -1;
+	return fread(&magic, 1, sizeof magic, j->f) == sizeof magic && magic == JOURNAL_MAGIC ? 0 : -1;
+}
+
+/* The output image is written sparsely, only pages that were loaded or
+ * written since are output, the rest being left as holes. Output that
+ * cannot seek, such as a pipe, has the holes written out as zeros. */
+static int image_write(vm_t *v, FILE *f) {
+	assert(v);
+	assert(f);
+	static const uint8_t zero[PAGE_SIZE];
+	const uint64_t loaded = (v->loaded + PAGE_MASK) / PAGE_SIZE, pages = v->msize / PAGE_SIZE;
+	const int seekable = ftell(f) >= 0;
+	uint64_t hole = 0; /* pages skipped over */
+	for (uint64_t pg = 0; pg <= pages; pg++) {
+		if (pg < pages && pg >= loaded && !page_get(v->touched, pg)) {
+			hole++;
+			continue;
+		}
+		if (hole && seekable && pg < pages) {
+			if (fseek(f, (long)(pg * PAGE_SIZE), SEEK_SET) < 0)
+				return -1;
+		} else if (hole && seekable) { /* extend the file to the full size of memory */
+			if (fseek(f, (long)(v->msize - 1ull), SEEK_SET) < 0 || fputc(0, f) == EOF)
+				return -1;
+		} else {
+			for (; hole; hole--)
+				if (fwrite(zero, 1, PAGE_SIZE, f) != PAGE_SIZE)
+					return -1;
+		}
+		hole = 0;
+		if (pg < pages && fwrite(((uint8_t*)v->m) + (pg * PAGE_SIZE), 1, PAGE_SIZE, f) != PAGE_SIZE)
+			return -1;
+	}
+	return 0;
+}
+
+/* Sizes are in bytes with an optional K, M or G suffix */
+static int parse_size(const char *s, uint64_t *size) {
+	assert(s);
+	assert(size);
+	char *end = NULL;
+	errno = 0;
+	uint64_t n = strtoull(s, &end, 0);
+	unsigned shift = 0;
+	switch (*end) {
+	case 'G': case 'g': shift += 10; /* fall-through */
+	case 'M': case 'm': shift += 10; /* fall-through */
+	case 'K': case 'k': shift += 10; end++; /* fall-through */
+	case '\0': break;
+	default: return -1;
+	}
+	if (n > (UINT64_MAX >> shift))
+		return -1;
+	n <<= shift;
+	if (errno || *end || end == s || n < PAGE_SIZE || n > MEMORY_MAX || (n & PAGE_MASK))
+		return -1;
+	*size = n;
+	return 0;
 }
 
 int main(int argc, char **argv) {
 	static vm_t v;
-	v.pc = MEMORY_START;
-	v.trace = stderr;
-	if (argc != 3)
+	v.msize = SIZE;
+	const char *deltas[64], *stats = NULL;
+	size_t ndeltas = 0;
+	const char *heatmap = NULL, *spec = NULL, *access = NULL;
+	uint64_t period = 1, ops = 0;
+	int i = 1, huge = 0, delta = 0, threads = 0;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+		switch (argv[i][1]) {
+		case 'd':
+			if (++i >= argc || hostfs_init(&v.hostfs, argv[i]) < 0) {
+				(void)fprintf(stderr, "cannot export directory '%s'\n", i < argc ? argv[i] : "");
+				return 1;
+			}
+			break;
+		case 's':
+			if (++i >= argc || shm_init(&v.shm, argv[i], SHM_SIZE) < 0) {
+				(void)fprintf(stderr, "cannot map shared memory '%s'\n", i < argc ? argv[i] : "");
+				return 1;
+			}
+			break;
+		case 'm':
+			if (++i >= argc || parse_size(argv[i], &v.msize) < 0) {
+				(void)fprintf(stderr, "invalid memory size '%s'\n", i < argc ? argv[i] : "");
+				return 1;
+			}
+			break;
+		case 'H': huge = 1; break;
+		case 'D': delta = 1; break;
+		case 'T': threads = 1; break;
+		case 'R': v.riscv = 1; break;
+		case 'C':
+		case 'A':
+			if (++i >= argc)
+				goto usage;
+			*(argv[i - 1][1] == 'C' ? &spec : &access) = argv[i];
+			break;
+		case 'M': {
+			if (++i >= argc)
+				goto usage;
+			char *comma = strrchr(argv[i], ',');
+			if (comma) {
+				*comma = '\0';
+				if (sscanf(comma + 1, "%"SCNu64, &period) != 1 || !period) {
+					(void)fprintf(stderr, "invalid heatmap period '%s'\n", comma + 1);
+					return 1;
+				}
+			}
+			heatmap = argv[i];
+			break;
+		}
+		case 'b': {
+			if (++i >= argc)
+				goto usage;
+			char *comma = strrchr(argv[i], ',');
+			if (comma) {
+				*comma = '\0';
+				if (sscanf(comma + 1, "%"SCNu64, &ops) != 1) {
+					(void)fprintf(stderr, "invalid operation count '%s'\n", comma + 1);
+					return 1;
+				}
+			}
+			stats = argv[i];
+			break;
+		}
+		case 'S':
+			if (++i >= argc)
+				goto usage;
+			v.snapshot = argv[i];
+			break;
+		case 'r':
+		case 'p':
+			if (++i >= argc || journal_open(&v.journal, argv[i], argv[i - 1][1] == 'r') < 0) {
+				(void)fprintf(stderr, "cannot open journal '%s'\n", i < argc ? argv[i] : "");
+				return 1;
+			}
+			break;
+		case 'a':
+			if (++i >= argc || ndeltas >= NELEMS(deltas))
+				goto usage;
+			deltas[ndeltas++] = argv[i];
+			break;
+		case 'n': {
+			int in = -1, out = -1;
+			if (++i >= argc || sscanf(argv[i], "%d,%d", &in, &out) != 2 || shm_notifiers(&v.shm, in, out) < 0) {
+				(void)fprintf(stderr, "invalid notification descriptors '%s'\n", i < argc ? argv[i] : "");
+				return 1;
+			}
+			break;
+		}
+		default:
+			goto usage;
+		}
+	}
+	if ((argc - i) != 2) {
+usage:
+		(void)fprintf(stderr, "usage: %s [-m size] [-H] [-d dir] [-s shm] [-n in,out] [-a delta]... [-S prefix] [-D] [-r|-p journal] [-T] [-R] [-M heatmap[,period]] [-C cache] [-A access] [-b stats[,operations]] in.img out.img\n", argv[0]);
+		return 1;
+	}
+	argv += i - 1;
+	if (vm_init(&v, v.msize, huge) < 0) {
+		(void)fprintf(stderr, "cannot allocate %"PRIu64" bytes of memory\n", v.msize);
+		return 1;
+	}
+	if (heatmap && heat_init(&v, heatmap, period) < 0) {
+		(void)fprintf(stderr, "cannot allocate heatmap\n");
+		return 1;
+	}
+	if (spec && cache_sim_init(&v.sim, spec) < 0) {
+		(void)fprintf(stderr, "invalid cache specification '%s'\n", spec);
 		return 1;
+	}
+	if (access) {
+		const uint64_t magic = CACHE_MAGIC;
+		if (!(v.access = fopen(access, "wb")) || fwrite(&magic, 1, sizeof magic, v.access) != sizeof magic) {
+			(void)fprintf(stderr, "cannot open access trace '%s'\n", access);
+			return 1;
+		}
+	}
+	v.simulate = spec != NULL;
+	v.profile |= spec || access;
 	FILE *fin = fopen(argv[1], "rb");
 	if (!fin)
 		return 2;
-	v.loaded = fread(v.m, 1, sizeof v.m, fin);
+	v.loaded = fread(v.m, 1, v.msize, fin);
 	if (fclose(fin) < 0)
 		return 3;
-	if (run(&v, 0) < 0)
+	for (size_t j = 0; j < ndeltas; j++) {
+		if (!(fin = fopen(deltas[j], "rb")))
+			return 2;
+		const int r = delta_read(&v, fin);
+		if (fclose(fin) < 0 || r < 0) {
+			(void)fprintf(stderr, "invalid delta '%s'\n", deltas[j]);
+			return 3;
+		}
+	}
+	memset(v.dirty, 0, bitmap_size(&v));
+	if (threads && (!THREADS || v.journal.mode != J_OFF)) {
+		(void)fprintf(stderr, "host I/O threads %s\n", THREADS ? "cannot be used with a journal" : "not built in, use USE_THREADS");
+		return 1;
+	}
+	if (threads && io_start(&v) < 0) {
+		(void)fprintf(stderr, "cannot start host I/O threads\n");
+		return 1;
+	}
+	const uint64_t start = now_ns();
+	const int r = run(&v, 0);
+	io_stop(&v);
+	restore(&v.console.terminal);
+	if (stats && bench(&v, stats, argv[1], ops, now_ns() - start) < 0)
+		return 4;
+	if (heatmap && heat_write(&v, heatmap) < 0)
+		return 4;
+	if (spec && cache_sim_report(&v.sim, stderr) < 0)
+		return 4;
+	if (v.access && fclose(v.access) < 0)
+		return 4;
+	if (v.journal.f && fclose(v.journal.f) < 0)
+		return 4;
+	if (r < 0)
 		return 4;
 	FILE *fout = fopen(argv[2], "wb");
 	if (!fout)
 		return 5;
-	(void)fwrite(v.m, 1, sizeof v.m, fout);
+	if ((delta ? delta_write(&v, fout, v.touched) : image_write(&v, fout)) < 0) {
+		(void)fclose(fout);
+		return 6;
+	}
 	if (fclose(fout) < 0)
 		return 6;
-	return 0;
+	return v.status;
 }
-
+#endif
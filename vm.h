@@ -0,0 +1,55 @@
+/* Embeddable interface to the virtual machine in 'vm.c'
+ * Author: Richard James Howe
+ * License: Public Domain
+ * Repository: https//github.com/howerj/os
+ *
+ * Build 'vm.c' with VM_NO_MAIN defined, or use 'libvm.a'. Each VM is self
+ * contained so any number may be used in one process, although only one
+ * thread may drive a given VM at a time. Addresses are guest physical. */
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm vm_t;
+
+/* Device callbacks for a page of I/O space, 'offset' is the word within the
+ * page. Return zero to carry on, VM_STOPPED to end 'vm_run' once the current
+ * instruction completes, or negative to fault the access. */
+typedef int (*vm_read_t)(void *param, uint64_t offset, uint64_t *val);
+typedef int (*vm_write_t)(void *param, uint64_t offset, uint64_t val);
+
+/* Console callbacks for the UART and HC_WRITE. 'vm_getch_t' returns a
+ * character or negative if none is waiting, it must not block. */
+typedef int (*vm_getch_t)(void *param);
+typedef int (*vm_putch_t)(void *param, int ch);
+
+enum { VM_BUDGET, VM_HALTED, VM_STOPPED, };   /* 'vm_run' results, negative on error */
+enum { VM_PC = 16, VM_FLAGS, VM_RV_X = 32, }; /* registers beyond the 16 general purpose ones */
+enum { VM_MMIO_FIRST = 8, };                  /* first I/O page free for host devices */
+
+/* With the RISC-V core registers 0 to 15, and VM_RV_X to VM_RV_X + 31, are
+ * x0 to x31 and VM_FLAGS is the privilege mode */
+
+vm_t *vm_create(uint64_t memory); /* memory in bytes, zero for the default */
+void vm_destroy(vm_t *v);
+int vm_load(vm_t *v, const void *image, size_t len);
+int vm_run(vm_t *v, uint64_t budget); /* run for 'budget' instructions, or until an event if zero */
+int vm_get_register(vm_t *v, unsigned reg, uint64_t *val);
+int vm_set_register(vm_t *v, unsigned reg, uint64_t val);
+int vm_read(vm_t *v, uint64_t addr, void *buf, size_t len);
+int vm_write(vm_t *v, uint64_t addr, const void *buf, size_t len);
+int vm_mmio(vm_t *v, unsigned page, vm_read_t read, vm_write_t write, void *param);
+int vm_interrupt(vm_t *v, unsigned irq);
+int vm_hostfs(vm_t *v, const char *dir); /* export a host directory, see the '-d' option */
+int vm_shm(vm_t *v, const char *name, int in, int out); /* map shared memory, see '-s' and '-n' */
+int vm_heatmap(vm_t *v, const char *file, uint64_t period); /* count memory accesses, see '-M' */
+int vm_heatmap_write(vm_t *v); /* write the counts so far to the heatmap file */
+int vm_riscv(vm_t *v); /* use the RV64IMA core, see '-R', before running */
+int vm_console(vm_t *v, vm_getch_t getch, vm_putch_t putch, void *param); /* NULL for the terminal, before 'vm_threads' */
+int vm_threads(vm_t *v, int on); /* host I/O threads, see '-T', fails if not built with USE_THREADS */
+uint64_t vm_instructions(vm_t *v);
+uint64_t vm_status(vm_t *v); /* exit status given by the guest */
+
+#endif